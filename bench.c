@@ -0,0 +1,583 @@
+/*
+ * Kernel microbenchmarks for simulation.c
+ *
+ * simulation.c is built into this file so its static kernels can be timed
+ * on their own, outside the threaded step:
+ *
+ *   distance  calc_periodic_distance() on particle pairs         (ns/call)
+ *   pairs     gather_neighbors() + accumulate_forces()           (ns/particle)
+ *   rebin     clear_bins(), coord_to_grid() + bin_particle()     (ns/particle)
+ *   merge     STEP 4, merge_plane() over every X plane           (ns/particle)
+ *   swap      STEP 5, swap_plane() over every X plane            (ns/plane)
+ *   step      a whole update_particles()                         (ns/particle)
+ *
+ * Every kernel runs on synthetic particles (uniform, clustered, one dense
+ * blob, sparse) for each requested particle count and repeats until the time
+ * budget is used. pairs, rebin, merge and step also run once per requested
+ * thread count: the threads split the particles (merge: the X planes) as
+ * the workers do, and ns/op is wall time over the work of all threads.
+ * distance and swap run on one thread. The pair loop times a spread-out
+ * sample of particles, so large counts stay affordable.
+ *
+ * Results are printed as one JSON object per line on stdout (or to -o FILE);
+ * the simulation's own messages go to stderr. Build with -DSIM_DIMS=2
+ * (make bench_2d) to time the planar kernels, or with -DSPARSE_GRID=1
+ * (make bench_sparse) to time the sparse grid.
+ */
+
+#include "simulation.c"
+#include <unistd.h>
+
+#define BENCH_MAX_LIST 16
+
+enum { DIST_UNIFORM, DIST_CLUSTERED, DIST_BLOB, DIST_SPARSE, NUM_DISTS };
+static const char *dist_names[NUM_DISTS] = {"uniform", "clustered", "blob", "sparse"};
+
+#define NUM_KERNELS 6
+static const char *kernel_names[NUM_KERNELS] = {"distance", "pairs", "rebin", "merge", "swap", "step"};
+
+/* Options */
+static long counts[BENCH_MAX_LIST] = {1000, 10000, 100000, 1000000, 10000000};
+static int num_counts = 5;
+static long thread_counts[BENCH_MAX_LIST] = {1, 2, 4};
+static int num_thread_counts = 3;
+static int dist_enabled[NUM_DISTS] = {1, 1, 1, 1};
+static int kernel_enabled[NUM_KERNELS] = {1, 1, 1, 1, 1, 1};
+static double budget_usec = 200000.0;
+static long step_max = 100000;
+static FILE *out;
+
+/* Flat view of the grid, rebuilt after every population */
+typedef struct {
+	Cell *particle;
+	short gx, gy, gz;
+} ParticleRef;
+
+static ParticleRef *refs = NULL;
+static long num_refs = 0;
+
+/* Blob centers for the clustered distribution, occupied cells for the sparse one */
+#define CLUSTER_CENTERS 16
+static float centers[CLUSTER_CENTERS][3];
+static int sparse_cells[GRID_SIZE * GRID_SIZE * GRID_SIZE_Z / 10 + 1][3];
+static int num_sparse_cells;
+
+static float uniform(void) {
+	return ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
+}
+
+/* Box-Muller normal sample */
+static float gaussian(float sigma) {
+	float u1, u2;
+	
+	u1 = ((float)rand() + 1.0f) / ((float)RAND_MAX + 1.0f);
+	u2 = (float)rand() / RAND_MAX;
+	return sigma * (float)(sqrt(-2.0 * log(u1)) * cos(6.2831853 * u2));
+}
+
+static void sample_position(int dist, float *x, float *y, float *z) {
+	int c;
+	
+	switch (dist) {
+		case DIST_CLUSTERED:
+			c = rand() % CLUSTER_CENTERS;
+			*x = centers[c][0] + gaussian(0.08f);
+			*y = centers[c][1] + gaussian(0.08f);
+			*z = centers[c][2] + gaussian(0.08f);
+			break;
+		case DIST_BLOB:
+			*x = gaussian(0.05f);
+			*y = gaussian(0.05f);
+			*z = gaussian(0.05f);
+			break;
+		case DIST_SPARSE:
+			/* Uniform inside roughly a tenth of the cells, the rest stay empty */
+			c = rand() % num_sparse_cells;
+			*x = -1.0f + (sparse_cells[c][0] + (float)rand() / RAND_MAX) * CELL_SIZE;
+			*y = -1.0f + (sparse_cells[c][1] + (float)rand() / RAND_MAX) * CELL_SIZE;
+			*z = -1.0f + (sparse_cells[c][2] + (float)rand() / RAND_MAX) * CELL_SIZE;
+			break;
+		default:
+			*x = uniform();
+			*y = uniform();
+			*z = uniform();
+			break;
+	}
+}
+
+/* Replace the grid contents with count particles of one distribution */
+static int populate(int dist, long count) {
+	int gx, gy, gz, c, num_cells;
+	long i;
+	float x, y, z, scale;
+	GridCell *cell;
+	ParticleRef *new_refs;
+	
+	clear_grids();
+	reset_ids();
+	total_particles = 0;
+	
+	scale = 0.7f;
+	for (c = 0; c < CLUSTER_CENTERS; c++) {
+		centers[c][0] = uniform() * scale;
+		centers[c][1] = uniform() * scale;
+		centers[c][2] = uniform() * scale;
+	}
+	num_sparse_cells = GRID_SIZE * GRID_SIZE * GRID_SIZE_Z / 10 + 1;
+	for (c = 0; c < num_sparse_cells; c++) {
+		sparse_cells[c][0] = rand() % GRID_SIZE;
+		sparse_cells[c][1] = rand() % GRID_SIZE;
+		sparse_cells[c][2] = rand() % GRID_SIZE_Z;
+	}
+	
+	for (i = 0; i < count; i++) {
+		sample_position(dist, &x, &y, &z);
+		if (spawn_particle(x, y, z, rand() % NUM_TYPES) < 0) return -1;
+	}
+	
+	new_refs = (ParticleRef*)realloc(refs, (count > 0 ? count : 1) * sizeof(ParticleRef));
+	if (!new_refs) {
+		printf("CRITICAL ERROR: Could not allocate memory!\n");
+		return -1;
+	}
+	refs = new_refs;
+	
+	num_refs = 0;
+	num_cells = grid_cell_count();
+	for (c = 0; c < num_cells; c++) {
+		cell = grid_cell(c, &gx, &gy, &gz);
+		for (i = 0; i < cell->count; i++) {
+			refs[num_refs].particle = &cell->particles[i];
+			refs[num_refs].gx = (short)gx;
+			refs[num_refs].gy = (short)gy;
+			refs[num_refs].gz = (short)gz;
+			num_refs++;
+		}
+	}
+	return 0;
+}
+
+static void emit(const char *kernel, int dist, long particles, int threads,
+				 double ops, double usec, const char *op, const char *extra) {
+	fprintf(out, "{\"kernel\":\"%s\",\"dist\":\"%s\",\"particles\":%ld,\"threads\":%d,"
+			"\"dims\":%d,\"grid\":%d,\"sparse\":%d,\"ops\":%.0f,\"op\":\"%s\",\"usec\":%.1f,\"ns_per_op\":%.3f%s}\n",
+			kernel, dist_names[dist], particles, threads, SIM_DIMS, GRID_SIZE, SPARSE_GRID,
+			ops, op, usec, ops > 0.0 ? usec * 1000.0 / ops : 0.0, extra ? extra : "");
+	fflush(out);
+}
+
+/* Keeps the compiler from dropping the results of the timed loops */
+static volatile float sink;
+
+/* One thread of a threaded kernel. Every thread repeats its share until the
+ * main thread raises stop_kernels - at least one pass, never cut short. */
+typedef struct {
+	int id;
+	int threads;
+	long work;   // Ops in one pass over this thread's share
+	long done;   // Ops completed
+	float sum;
+} BenchThread;
+
+static volatile int stop_kernels;
+
+/* Run kernel on threads threads for the time budget. Returns the wall time
+ * and the ops done by all threads together, or -1.0 if no thread started. */
+static double run_threads(void *(*kernel)(void *), BenchThread *data, int threads, long *done) {
+	pthread_t ids[MAX_THREADS];
+	struct timespec pause;
+	double start, elapsed;
+	int t, started;
+	
+	pause.tv_sec = 0;
+	pause.tv_nsec = 1000000;
+	
+	stop_kernels = 0;
+	start = time_usec();
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&ids[started], NULL, kernel, &data[started]) != 0) {
+			printf("ERROR: Could not create benchmark thread\n");
+			break;
+		}
+	}
+	
+	while (started > 0 && time_usec() - start < budget_usec) {
+		nanosleep(&pause, NULL);
+	}
+	stop_kernels = 1;
+	
+	*done = 0;
+	for (t = 0; t < started; t++) {
+		pthread_join(ids[t], NULL);
+		*done += data[t].done;
+	}
+	elapsed = time_usec() - start;
+	
+	return started > 0 ? elapsed : -1.0;
+}
+
+static void init_bench_threads(BenchThread *data, int threads) {
+	int t;
+	
+	for (t = 0; t < threads; t++) {
+		data[t].id = t;
+		data[t].threads = threads;
+		data[t].work = 0;
+		data[t].done = 0;
+		data[t].sum = 0.0f;
+	}
+}
+
+static void bench_distance(int dist) {
+	long k, a, b, calls;
+	float dx, dy, dz, sum;
+	double start, elapsed;
+	
+	if (num_refs < 2) return;
+	
+	calls = 0;
+	sum = 0.0f;
+	start = time_usec();
+	do {
+		for (k = 0; k < 65536; k++) {
+			a = k % num_refs;
+			b = (k * 7919 + 13) % num_refs;
+			calc_periodic_distance(refs[a].particle->x, refs[a].particle->y, CELL_Z(refs[a].particle),
+								   refs[b].particle->x, refs[b].particle->y, CELL_Z(refs[b].particle),
+								   &dx, &dy, &dz);
+			sum += dx + dy + dz;
+		}
+		calls += 65536;
+		elapsed = time_usec() - start;
+	} while (elapsed < budget_usec);
+	
+	sink = sum;
+	emit("distance", dist, num_refs, 1, (double)calls, elapsed, "call", NULL);
+}
+
+/* Stride through the particles that spreads a pair sample over every cell */
+static long pair_stride(void) {
+	long stride;
+	
+	/* A large prime */
+	stride = 1000003 % num_refs;
+	return stride == 0 ? 1 : stride;
+}
+
+/* Thread t times particles t, t + threads, ... of the strided sequence */
+static void* pairs_thread(void *arg) {
+	BenchThread *data = (BenchThread*)arg;
+	long index, step, k;
+	int num_neighbors;
+	float fx, fy, fz, sum;
+	GridCell *neighbors;
+	ParticleRef *ref;
+	
+	/* The neighbor buffer of the worker with the same id */
+	if (reserve((void**)&thread_data[data->id].neighbors, &thread_data[data->id].neighbor_capacity,
+				stencil_slots, sizeof(GridCell)) != 0) return NULL;
+	neighbors = thread_data[data->id].neighbors;
+	
+	index = (data->id * pair_stride()) % num_refs;
+	step = (data->threads * pair_stride()) % num_refs;
+	sum = 0.0f;
+	do {
+		for (k = 0; k < 16; k++) {
+			ref = &refs[index];
+			num_neighbors = gather_neighbors(ref->gx, ref->gy, ref->gz, neighbors);
+			accumulate_forces(ref->particle, neighbors, num_neighbors, &sim_params, &fx, &fy, &fz);
+			sum += fx + fy + fz;
+			index = (index + step) % num_refs;
+		}
+		data->done += 16;
+	} while (!stop_kernels);
+	
+	data->sum = sum;
+	return NULL;
+}
+
+static void bench_pairs(int dist, int threads) {
+	long k, index, done, sample, candidates;
+	int n, num_neighbors;
+	double elapsed;
+	char extra[64];
+	GridCell *neighbors;
+	BenchThread data[MAX_THREADS];
+	ParticleRef *ref;
+	
+	if (num_refs == 0) return;
+	
+	update_stencil(sim_params.max_dist_sq);
+	init_bench_threads(data, threads);
+	elapsed = run_threads(pairs_thread, data, threads, &done);
+	if (elapsed < 0.0) return;
+	
+	/* Candidate pairs per particle of the strided sample, counted outside the timing */
+	if (thread_data[0].neighbor_capacity < stencil_slots) return;
+	neighbors = thread_data[0].neighbors;
+	sample = done < num_refs ? done : num_refs;
+	candidates = 0;
+	index = 0;
+	for (k = 0; k < sample; k++) {
+		ref = &refs[index];
+		num_neighbors = gather_neighbors(ref->gx, ref->gy, ref->gz, neighbors);
+		for (n = 0; n < num_neighbors; n++) {
+			candidates += neighbors[n].count;
+		}
+		index = (index + pair_stride()) % num_refs;
+	}
+	
+	sink = data[0].sum;
+	sprintf(extra, ",\"pairs_per_op\":%.1f", sample > 0 ? (double)candidates / sample : 0.0);
+	emit("pairs", dist, num_refs, threads, (double)done, elapsed, "particle", extra);
+}
+
+/* Thread t rebins particles t, t + threads, ... into its own bins */
+static void* rebin_thread(void *arg) {
+	BenchThread *data = (BenchThread*)arg;
+	long k;
+	Cell *particle;
+	
+	do {
+		clear_bins(data->id);
+		for (k = data->id; k < num_refs; k += data->threads) {
+			particle = refs[k].particle;
+			bin_particle(data->id, particle, coord_to_grid(particle->x), coord_to_grid(particle->y),
+						 coord_to_grid_z(CELL_Z(particle)));
+		}
+		data->done += data->work;
+	} while (!stop_kernels);
+	
+	return NULL;
+}
+
+/* Rebins every particle into one set of bins per thread, as the workers
+ * would. Also fills them for bench_merge() with the same thread count. */
+static void bench_rebin(int dist, int threads) {
+	long done;
+	int t;
+	double elapsed;
+	BenchThread data[MAX_THREADS];
+	
+	if (num_refs == 0) return;
+	
+	init_bench_threads(data, threads);
+	for (t = 0; t < threads; t++) {
+		data[t].work = (num_refs - t + threads - 1) / threads;
+	}
+	elapsed = run_threads(rebin_thread, data, threads, &done);
+	if (elapsed < 0.0) return;
+	
+	if (kernel_enabled[2]) {
+		emit("rebin", dist, num_refs, threads, (double)done, elapsed, "particle", NULL);
+	}
+}
+
+/* Thread t merges its own slab of X planes, like STEP 4 of a worker */
+static void* merge_thread(void *arg) {
+	BenchThread *data = (BenchThread*)arg;
+	int gx, slab_start, slab_end;
+	
+	slab_start = data->id * GRID_SIZE / data->threads;
+	slab_end = (data->id + 1) * GRID_SIZE / data->threads;
+	do {
+		for (gx = slab_start; gx < slab_end; gx++) {
+			merge_plane(gx, data->id);
+		}
+		data->done += data->work;
+	} while (!stop_kernels);
+	
+	return NULL;
+}
+
+/* Needs the bins filled by bench_rebin() with the same thread count */
+static void bench_merge(int dist, int threads) {
+	long k, done;
+	int t;
+	double elapsed;
+	BenchThread data[MAX_THREADS];
+	
+	if (num_refs == 0) return;
+	
+	/* merge_plane() reads the bins of num_threads workers */
+	num_threads = threads;
+	init_bench_threads(data, threads);
+	for (k = 0; k < num_refs; k++) {
+		t = 0;
+		while ((t + 1) * GRID_SIZE / threads <= refs[k].gx) t++;
+		data[t].work++;
+	}
+	elapsed = run_threads(merge_thread, data, threads, &done);
+	if (elapsed < 0.0) return;
+	
+	emit("merge", dist, num_refs, threads, (double)done, elapsed, "particle", NULL);
+}
+
+static void bench_swap(int dist) {
+	int gx, pass;
+	long done;
+	double start, elapsed;
+	
+	done = 0;
+	start = time_usec();
+	do {
+		/* Swap twice so grid ends up with its own particles again */
+		for (pass = 0; pass < 2; pass++) {
+			for (gx = 0; gx < GRID_SIZE; gx++) {
+				swap_plane(gx);
+			}
+		}
+		done += 2 * GRID_SIZE;
+		elapsed = time_usec() - start;
+	} while (elapsed < budget_usec);
+	
+	emit("swap", dist, num_refs, 1, (double)done, elapsed, "plane", NULL);
+}
+
+/* Whole steps, including thread synchronization, for one thread count */
+static void bench_step(int dist, long count, int threads) {
+	long steps;
+	double start, elapsed;
+	
+	if (populate(dist, count) != 0) return;
+	
+	num_threads = threads;
+	init_threads();
+	if (!threads_running) return;
+	
+	/* The first step also moves the buffers to their owning threads */
+	update_particles();
+	
+	steps = 0;
+	start = time_usec();
+	do {
+		update_particles();
+		steps++;
+		elapsed = time_usec() - start;
+	} while (elapsed < budget_usec);
+	
+	emit("step", dist, count, num_threads, (double)steps * count, elapsed, "particle", NULL);
+	
+	/* Also frees the grids - the next population reallocates them */
+	cleanup_threads();
+}
+
+/* Parse "a,b,c" into values, returns the number parsed */
+static int parse_list(const char *text, long *values) {
+	int n;
+	char *end;
+	
+	n = 0;
+	while (*text && n < BENCH_MAX_LIST) {
+		values[n++] = strtol(text, &end, 10);
+		if (*end != ',') break;
+		text = end + 1;
+	}
+	return n;
+}
+
+/* Enable the comma separated names, disable the rest */
+static void parse_names(const char *text, const char **names, int *enabled, int count) {
+	int i;
+	const char *match;
+	size_t length;
+	
+	for (i = 0; i < count; i++) {
+		enabled[i] = 0;
+		length = strlen(names[i]);
+		for (match = strstr(text, names[i]); match; match = strstr(match + 1, names[i])) {
+			if ((match == text || match[-1] == ',') &&
+				(match[length] == '\0' || match[length] == ',')) {
+				enabled[i] = 1;
+				break;
+			}
+		}
+	}
+}
+
+static void usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-counts N,N,...] [-threads N,N,...] [-dists uniform,clustered,blob,sparse]\n"
+			"          [-kernels distance,pairs,rebin,merge,swap,step] [-time SECONDS]\n"
+			"          [-stepmax N] [-seed N] [-o FILE]\n", program);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	int i, c, d, threads;
+	unsigned int seed;
+	
+	/* JSON goes to the original stdout, everything the simulation prints to stderr */
+	fflush(stdout);
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		fprintf(stderr, "Could not redirect stdout\n");
+		return 1;
+	}
+	setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+	seed = 1;
+	
+	for (i = 1; i < argc; i++) {
+		if (i + 1 >= argc) usage(argv[0]);
+		if (strcmp(argv[i], "-counts") == 0) {
+			num_counts = parse_list(argv[++i], counts);
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			num_thread_counts = parse_list(argv[++i], thread_counts);
+		} else if (strcmp(argv[i], "-dists") == 0) {
+			parse_names(argv[++i], dist_names, dist_enabled, NUM_DISTS);
+		} else if (strcmp(argv[i], "-kernels") == 0) {
+			parse_names(argv[++i], kernel_names, kernel_enabled, NUM_KERNELS);
+		} else if (strcmp(argv[i], "-time") == 0) {
+			budget_usec = atof(argv[++i]) * 1000000.0;
+		} else if (strcmp(argv[i], "-stepmax") == 0) {
+			step_max = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-seed") == 0) {
+			seed = (unsigned int)atol(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0) {
+			fclose(out);
+			out = fopen(argv[++i], "w");
+			if (!out) {
+				fprintf(stderr, "Could not open %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			usage(argv[0]);
+		}
+	}
+	
+	/* Every thread count within what the simulation supports */
+	for (i = 0; i < num_thread_counts; i++) {
+		if (thread_counts[i] < 1) thread_counts[i] = 1;
+		if (thread_counts[i] > MAX_THREADS) thread_counts[i] = MAX_THREADS;
+	}
+	
+	for (d = 0; d < NUM_DISTS; d++) {
+		if (!dist_enabled[d]) continue;
+		
+		for (c = 0; c < num_counts; c++) {
+			/* Same particles for every kernel of one (distribution, count) */
+			srand(seed);
+			if (populate(d, counts[c]) != 0) continue;
+			
+			if (kernel_enabled[0]) bench_distance(d);
+			for (i = 0; i < num_thread_counts; i++) {
+				threads = (int)thread_counts[i];
+				if (kernel_enabled[1]) bench_pairs(d, threads);
+				if (kernel_enabled[2] || kernel_enabled[3]) bench_rebin(d, threads);
+				if (kernel_enabled[3]) bench_merge(d, threads);
+			}
+			if (kernel_enabled[4]) bench_swap(d);
+			
+			if (kernel_enabled[5] && counts[c] <= step_max) {
+				for (i = 0; i < num_thread_counts; i++) {
+					srand(seed);
+					bench_step(d, counts[c], (int)thread_counts[i]);
+				}
+			}
+		}
+	}
+	
+	cleanup_threads();
+	free(refs);
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,485 @@
+/*
+ * On-the-fly cluster detection
+ *
+ * Every cluster_interval steps the particles are split into connected
+ * components: two particles are linked when they are closer than
+ * cluster_link_distance. The pass reuses the spatial grid and the worker
+ * slabs. Particles are numbered in grid cell order (X plane by X plane), so every
+ * worker owns one contiguous index range and can run union-find on it
+ * without locks while it computes forces. Links that cross into the next
+ * worker's slab are collected and joined by the main thread afterwards.
+ *
+ * The cells searched around every cell cover the whole link distance, so
+ * the result does not depend on GRID_SIZE. Like the force pass, neighbor
+ * cells do not wrap around the world edges.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "simulation.h"
+#include "clusters.h"
+
+/* Options */
+int cluster_interval = 0;
+float cluster_link_distance = 0.06f;
+int cluster_min_size = 4;
+
+ClusterStats cluster_stats;
+
+/* Links between particles owned by different workers: pairs[2k], pairs[2k+1] */
+typedef struct {
+	int count;
+	int capacity;
+	int *pairs;
+} EdgeList;
+
+/* Per-particle arrays, indexed by the position in the cell-ordered numbering */
+static int *parent = NULL;
+static int *component_size = NULL;
+static unsigned char *particle_type = NULL;  /* TYPE_REMOVED for removed particles */
+static int index_capacity = 0;
+static int num_indexed = 0;
+
+static int *cell_offset = NULL;  /* First index of every grid cell, plus the total */
+static int offset_capacity = 0;
+static EdgeList cross_edges[MAX_THREADS];
+static double link_usec[MAX_THREADS];
+static double prepare_usec;
+
+/* Particles removed since the last step are still in the grid - they get
+ * this type and are neither linked nor counted */
+#define TYPE_REMOVED 0xff
+
+/* Forward half of the cells within the link distance - every cell pair is
+ * visited once. Rebuilt when cluster_link_distance changes. */
+typedef struct {
+	int dx, dy, dz;
+} CellOffset;
+
+static CellOffset *half_stencil = NULL;
+static int half_stencil_size = 0;
+static int half_stencil_capacity = 0;
+static float half_stencil_distance = -1.0f;
+
+/* Occupied forward neighbors of the cell being linked, one buffer per worker */
+typedef struct {
+	GridCell *cell;
+	int base;      /* Index of its first particle */
+	int remote;    /* Owned by a later worker */
+} LinkNeighbor;
+
+static LinkNeighbor *link_neighbors[MAX_THREADS];
+static int link_capacity[MAX_THREADS];
+
+/* Squared distance of two particles, without the Z term in 2D */
+#if SIM_DIMS == 3
+#define DIST_SQ(a, b) (((a)->x - (b)->x) * ((a)->x - (b)->x) + \
+					   ((a)->y - (b)->y) * ((a)->y - (b)->y) + \
+					   ((a)->z - (b)->z) * ((a)->z - (b)->z))
+#else
+#define DIST_SQ(a, b) (((a)->x - (b)->x) * ((a)->x - (b)->x) + \
+					   ((a)->y - (b)->y) * ((a)->y - (b)->y))
+#endif
+
+static double time_usec(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1000000.0 + (double)tv.tv_usec;
+}
+
+/* Find with path halving */
+static int find_root(int i) {
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+/* Union - the smaller index becomes the root, so roots stay inside the
+ * range of the worker that linked them */
+static void union_particles(int a, int b) {
+	a = find_root(a);
+	b = find_root(b);
+	if (a == b) return;
+	if (a < b) parent[b] = a;
+	else parent[a] = b;
+}
+
+static void add_edge(EdgeList *edges, int a, int b) {
+	int new_capacity;
+	int *new_pairs;
+	
+	if (edges->count >= edges->capacity) {
+		new_capacity = edges->capacity == 0 ? 256 : edges->capacity * 2;
+		new_pairs = (int*)realloc(edges->pairs, new_capacity * 2 * sizeof(int));
+		if (!new_pairs) {
+			printf("CRITICAL ERROR: Could not allocate memory!\n");
+			return;
+		}
+		edges->pairs = new_pairs;
+		edges->capacity = new_capacity;
+	}
+	
+	edges->pairs[edges->count * 2] = a;
+	edges->pairs[edges->count * 2 + 1] = b;
+	edges->count++;
+}
+
+/* Smallest distance between two cells d cells apart along one axis */
+static float cell_gap(int d) {
+	if (d < 0) d = -d;
+	return d > 1 ? (d - 1) * CELL_SIZE : 0.0f;
+}
+
+/* Grow an array to hold at least needed elements, 0 on success */
+static int reserve(void **array, int *capacity, int needed, size_t element_size) {
+	int new_capacity;
+	void *new_array;
+	
+	if (needed <= *capacity) return 0;
+	
+	new_capacity = needed + needed / 2;
+	new_array = realloc(*array, new_capacity * element_size);
+	if (!new_array) {
+		printf("CRITICAL ERROR: Could not allocate memory!\n");
+		return -1;
+	}
+	*array = new_array;
+	*capacity = new_capacity;
+	return 0;
+}
+
+/* Collect the forward cell offsets that can hold a particle closer than the
+ * link distance. Returns 0 on success. */
+static int build_half_stencil(void) {
+	int dx, dy, dz, range, range_z, size;
+	float link_sq, gap_sq;
+	
+	if (cluster_link_distance == half_stencil_distance) return 0;
+	
+	/* Cells further away than this are more than the link distance apart */
+	if (cluster_link_distance / CELL_SIZE + 1.0f >= GRID_SIZE - 1) {
+		range = GRID_SIZE - 1;
+	} else {
+		range = (int)(cluster_link_distance / CELL_SIZE) + 1;
+		if (range < 1) range = 1;
+	}
+	range_z = range < GRID_SIZE_Z - 1 ? range : GRID_SIZE_Z - 1;
+	
+	if (reserve((void**)&half_stencil, &half_stencil_capacity,
+				(2 * range + 1) * (2 * range + 1) * (2 * range_z + 1), sizeof(CellOffset)) != 0) {
+		return -1;
+	}
+	
+	link_sq = cluster_link_distance * cluster_link_distance;
+	size = 0;
+	for (dx = 0; dx <= range; dx++) {
+		for (dy = -range; dy <= range; dy++) {
+			for (dz = -range_z; dz <= range_z; dz++) {
+				/* Forward only: X first, then Y, then Z */
+				if (dx == 0 && (dy < 0 || (dy == 0 && dz <= 0))) continue;
+				
+				gap_sq = cell_gap(dx) * cell_gap(dx) + cell_gap(dy) * cell_gap(dy) +
+						 cell_gap(dz) * cell_gap(dz);
+				if (gap_sq > link_sq) continue;
+				
+				half_stencil[size].dx = dx;
+				half_stencil[size].dy = dy;
+				half_stencil[size].dz = dz;
+				size++;
+			}
+		}
+	}
+	
+	half_stencil_size = size;
+	half_stencil_distance = cluster_link_distance;
+	return 0;
+}
+
+int clusters_due(long step) {
+	return cluster_interval > 0 && step % cluster_interval == 0;
+}
+
+/* Number the particles and size the arrays - main thread, before the step */
+void clusters_prepare(void) {
+	int c, num_cells, t, count, new_capacity;
+	int *new_parent, *new_size, *new_offset;
+	unsigned char *new_type;
+	double start;
+	
+	start = time_usec();
+	
+	for (t = 0; t < MAX_THREADS; t++) {
+		cross_edges[t].count = 0;
+		link_usec[t] = 0.0;
+	}
+	
+	/* Cells to search and one neighbor buffer per worker */
+	if (build_half_stencil() != 0) {
+		num_indexed = 0;  /* Analyse nothing */
+		prepare_usec = time_usec() - start;
+		return;
+	}
+	for (t = 0; t < num_threads; t++) {
+		if (reserve((void**)&link_neighbors[t], &link_capacity[t], half_stencil_size, sizeof(LinkNeighbor)) != 0) {
+			num_indexed = 0;
+			prepare_usec = time_usec() - start;
+			return;
+		}
+	}
+	
+	num_cells = grid_cell_count();
+	if (num_cells + 1 > offset_capacity) {
+		new_capacity = num_cells + 1 + num_cells / 2;
+		new_offset = (int*)realloc(cell_offset, new_capacity * sizeof(int));
+		if (!new_offset) {
+			printf("CRITICAL ERROR: Could not allocate memory!\n");
+			num_indexed = 0;  /* Analyse nothing */
+			prepare_usec = time_usec() - start;
+			return;
+		}
+		cell_offset = new_offset;
+		offset_capacity = new_capacity;
+	}
+	
+	count = 0;
+	for (c = 0; c < num_cells; c++) {
+		cell_offset[c] = count;
+		count += grid_cell(c, NULL, NULL, NULL)->count;
+	}
+	cell_offset[num_cells] = count;
+	
+	if (count > index_capacity) {
+		new_capacity = count + count / 2;
+		new_parent = (int*)realloc(parent, new_capacity * sizeof(int));
+		if (new_parent) parent = new_parent;
+		new_size = (int*)realloc(component_size, new_capacity * sizeof(int));
+		if (new_size) component_size = new_size;
+		new_type = (unsigned char*)realloc(particle_type, new_capacity);
+		if (new_type) particle_type = new_type;
+		
+		if (!new_parent || !new_size || !new_type) {
+			printf("CRITICAL ERROR: Could not allocate memory!\n");
+			count = 0;  /* Analyse nothing rather than overrun the arrays */
+		} else {
+			index_capacity = new_capacity;
+		}
+	}
+	num_indexed = count;
+	prepare_usec = time_usec() - start;
+}
+
+/* Link the particles of one worker slab - runs on the worker during the
+ * force pass, while the grid is read-only */
+void clusters_link_slab(int thread_id, int slab_start, int slab_end) {
+	int c, first_cell, last_cell, other_index, num_others;
+	int gx, gy, gz, ngx;
+	int i, j, n, first, last, base, other_base;
+	float link_dist_sq;
+	double start;
+	GridCell *cell, *other_cell;
+	LinkNeighbor *others;
+	Cell *particle, *other_particle;
+	
+	if (num_indexed == 0) return;
+	
+	start = time_usec();
+	
+	link_dist_sq = cluster_link_distance * cluster_link_distance;
+	others = link_neighbors[thread_id];
+	
+	/* This slab's particles are one contiguous index range */
+	first_cell = grid_first_cell(slab_start);
+	last_cell = grid_first_cell(slab_end);
+	first = cell_offset[first_cell];
+	last = cell_offset[last_cell];
+	for (i = first; i < last; i++) {
+		parent[i] = i;
+	}
+	
+	/* Types first, so links inside the slab can skip removed particles */
+	for (c = first_cell; c < last_cell; c++) {
+		cell = grid_cell(c, NULL, NULL, NULL);
+		base = cell_offset[c];
+		for (i = 0; i < cell->count; i++) {
+			particle = &cell->particles[i];
+			particle_type[base + i] = particle_removed(particle->id) ?
+				TYPE_REMOVED : (unsigned char)particle->type;
+		}
+	}
+	
+	for (c = first_cell; c < last_cell; c++) {
+		cell = grid_cell(c, &gx, &gy, &gz);
+		if (cell->count == 0) continue;
+		base = cell_offset[c];
+		
+		/* Occupied forward neighbor cells, looked up once per cell */
+		num_others = 0;
+		for (n = 0; n < half_stencil_size; n++) {
+			ngx = gx + half_stencil[n].dx;
+			other_cell = grid_find(ngx, gy + half_stencil[n].dy, gz + half_stencil[n].dz, &other_index);
+			if (!other_cell || other_cell->count == 0) continue;
+			others[num_others].cell = other_cell;
+			others[num_others].base = cell_offset[other_index];
+			others[num_others].remote = ngx >= slab_end;
+			num_others++;
+		}
+		
+		for (i = 0; i < cell->count; i++) {
+			if (particle_type[base + i] == TYPE_REMOVED) continue;
+			particle = &cell->particles[i];
+			
+			/* Pairs inside the same cell */
+			for (j = i + 1; j < cell->count; j++) {
+				other_particle = &cell->particles[j];
+				if (particle_type[base + j] == TYPE_REMOVED) continue;
+				if (DIST_SQ(particle, other_particle) < link_dist_sq) {
+					union_particles(base + i, base + j);
+				}
+			}
+			
+			/* Pairs with the forward neighbor cells */
+			for (n = 0; n < num_others; n++) {
+				other_cell = others[n].cell;
+				other_base = others[n].base;
+				
+				for (j = 0; j < other_cell->count; j++) {
+					other_particle = &other_cell->particles[j];
+					if (DIST_SQ(particle, other_particle) >= link_dist_sq) continue;
+					
+					if (!others[n].remote) {
+						if (particle_type[other_base + j] == TYPE_REMOVED) continue;
+						union_particles(base + i, other_base + j);
+					} else {
+						/* Join after the step, once the next worker has typed its particles */
+						add_edge(&cross_edges[thread_id], base + i, other_base + j);
+					}
+				}
+			}
+		}
+	}
+	
+	link_usec[thread_id] = time_usec() - start;
+}
+
+/* Join the cross-slab links and compute the statistics - main thread, after the step */
+void clusters_finish(long step) {
+	int i, t, k, a, b, root, size, bin, largest_root;
+	double start, max_link_usec;
+	
+	start = time_usec();
+	
+	memset(&cluster_stats, 0, sizeof(cluster_stats));
+	cluster_stats.valid = 1;
+	cluster_stats.step = step;
+	
+	max_link_usec = 0.0;
+	for (t = 0; t < MAX_THREADS; t++) {
+		for (k = 0; k < cross_edges[t].count; k++) {
+			a = cross_edges[t].pairs[k * 2];
+			b = cross_edges[t].pairs[k * 2 + 1];
+			if (particle_type[b] == TYPE_REMOVED) continue;
+			union_particles(a, b);
+		}
+		if (link_usec[t] > max_link_usec) max_link_usec = link_usec[t];
+	}
+	
+	/* Flatten every tree and count the component sizes */
+	for (i = 0; i < num_indexed; i++) {
+		component_size[i] = 0;
+	}
+	for (i = 0; i < num_indexed; i++) {
+		root = find_root(i);
+		parent[i] = root;
+		component_size[root]++;
+	}
+	
+	/* Size distribution over all components, clusters are the big ones */
+	largest_root = -1;
+	for (i = 0; i < num_indexed; i++) {
+		if (parent[i] != i || particle_type[i] == TYPE_REMOVED) continue;
+		cluster_stats.particles += component_size[i];
+		size = component_size[i];
+		
+		bin = 0;
+		while ((2 << bin) <= size && bin < CLUSTER_SIZE_BINS - 1) {
+			bin++;
+		}
+		cluster_stats.size_histogram[bin]++;
+		
+		if (size >= cluster_min_size) cluster_stats.clusters++;
+		if (size > cluster_stats.largest) {
+			cluster_stats.largest = size;
+			largest_root = i;
+		}
+	}
+	
+	/* Type composition */
+	for (i = 0; i < num_indexed; i++) {
+		if (particle_type[i] == TYPE_REMOVED) continue;
+		root = parent[i];
+		if (component_size[root] >= cluster_min_size) {
+			cluster_stats.clustered++;
+			cluster_stats.type_counts[particle_type[i]]++;
+		}
+		if (root == largest_root) {
+			cluster_stats.largest_types[particle_type[i]]++;
+		}
+	}
+	
+	cluster_stats.usec = prepare_usec + max_link_usec + (time_usec() - start);
+}
+
+void print_cluster_stats(void) {
+	int bin, t;
+	
+	printf("Clusters at step %ld: %d clusters of >= %d particles, largest %d, "
+		   "%d of %d particles clustered (%.3f ms)\n",
+		   cluster_stats.step, cluster_stats.clusters, cluster_min_size,
+		   cluster_stats.largest, cluster_stats.clustered, cluster_stats.particles,
+		   cluster_stats.usec / 1000.0);
+	
+	printf("  sizes:");
+	for (bin = 0; bin < CLUSTER_SIZE_BINS; bin++) {
+		if (cluster_stats.size_histogram[bin] == 0) continue;
+		printf(" %d-%d:%d", 1 << bin, (2 << bin) - 1, cluster_stats.size_histogram[bin]);
+	}
+	printf("\n  clustered by type:");
+	for (t = 0; t < NUM_TYPES; t++) {
+		printf(" %d", cluster_stats.type_counts[t]);
+	}
+	printf("\n  largest by type:");
+	for (t = 0; t < NUM_TYPES; t++) {
+		printf(" %d", cluster_stats.largest_types[t]);
+	}
+	printf("\n");
+}
+
+void clusters_cleanup(void) {
+	int t;
+	
+	free(parent);
+	free(component_size);
+	free(particle_type);
+	free(cell_offset);
+	parent = component_size = cell_offset = NULL;
+	particle_type = NULL;
+	index_capacity = num_indexed = offset_capacity = 0;
+	
+	for (t = 0; t < MAX_THREADS; t++) {
+		free(cross_edges[t].pairs);
+		cross_edges[t].pairs = NULL;
+		cross_edges[t].count = cross_edges[t].capacity = 0;
+		free(link_neighbors[t]);
+		link_neighbors[t] = NULL;
+		link_capacity[t] = 0;
+	}
+	
+	free(half_stencil);
+	half_stencil = NULL;
+	half_stencil_size = half_stencil_capacity = 0;
+	half_stencil_distance = -1.0f;
+}
@@ -0,0 +1,37 @@
+#ifndef CLUSTERS_H
+#define CLUSTERS_H
+
+#include "simulation.h"
+
+#define CLUSTER_SIZE_BINS 16  /* Histogram bin k counts clusters of 2^k .. 2^(k+1)-1 particles */
+
+typedef struct {
+	int valid;                           // Set once an analysis has run
+	long step;                           // Step the analysis ran on
+	int particles;                       // Particles analysed (removed ones are skipped)
+	int clusters;                        // Components with at least cluster_min_size particles
+	int clustered;                       // Particles that belong to those components
+	int largest;                         // Size of the largest component
+	int size_histogram[CLUSTER_SIZE_BINS];
+	int type_counts[NUM_TYPES];          // Per-type count of clustered particles
+	int largest_types[NUM_TYPES];        // Type composition of the largest component
+	double usec;                         // Wall time spent on the analysis
+} ClusterStats;
+
+/* Options - set before init_threads() */
+extern int cluster_interval;         // Run the analysis every N steps (0 = off)
+extern float cluster_link_distance;  // Particles closer than this are linked
+extern int cluster_min_size;         // Smaller components are not counted as clusters
+
+/* Result of the most recent analysis */
+extern ClusterStats cluster_stats;
+
+/* Functions - called by the simulation, not by the front end */
+int clusters_due(long step);
+void clusters_prepare(void);
+void clusters_link_slab(int thread_id, int slab_start, int slab_end);
+void clusters_finish(long step);
+void clusters_cleanup(void);
+void print_cluster_stats(void);
+
+#endif
@@ -0,0 +1,528 @@
+/*
+ * Local control and telemetry socket
+ *
+ * A server thread accepts one client at a time on a Unix-domain socket and
+ * queues its commands. The main thread applies them in control_begin_step(),
+ * between simulation steps, so nothing here ever touches the grid while the
+ * workers are running.
+ *
+ * Commands (one per line):
+ *   pause | resume | step N | reset | count N | quit
+ *   spawn TYPE X Y Z [N] | remove ID | removetype TYPE N
+ *   removeregion X0 Y0 Z0 X1 Y1 Z1
+ *   set NAME VALUE      (vmix, center_force, base_radius, collision_force,
+ *                        max_dist_sq, force_scale)
+ *   get                 (print all parameters)
+ *   attract I J VALUE   (attraction of type I toward type J)
+ *   camera X Y Z
+ *   snapshot FILE
+ *   stats on|off        (stream one line per step, plus cluster results)
+ *   clusters N          (run the cluster analysis every N steps, 0 = off)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "simulation.h"
+#include "control.h"
+#include "clusters.h"
+
+#define CONTROL_QUEUE_SIZE 32
+#define CONTROL_LINE_SIZE 256
+#define CONTROL_OUTPUT_SIZE 65536  /* Replies and stats waiting for a slow client */
+#define CONTROL_MAX_PARTICLES 1000000  /* Largest count, and largest spawn batch */
+
+/* Server state */
+static pthread_t server_thread;
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int server_running = 0;
+static int listen_fd = -1;
+static int client_fd = -1;
+static char socket_file[CONTROL_LINE_SIZE];
+
+/* Output not yet accepted by the client socket, flushed when it is writable */
+static char output[CONTROL_OUTPUT_SIZE];
+static int output_len = 0;
+
+/* Command queue, filled by the server thread and drained by the main thread */
+static char queue[CONTROL_QUEUE_SIZE][CONTROL_LINE_SIZE];
+static int queue_head = 0;
+static int queue_count = 0;
+
+/* Run state, only touched by the main thread */
+static int paused = 0;
+static long step_credit = 0;       /* Steps left to run while paused */
+static int stepping = 0;           /* A "step N" request is in progress */
+static int quit_requested = 0;
+static int stream_stats = 0;
+static long steps_done = 0;
+static long cluster_step_sent = -1;  /* Step of the last cluster result streamed (-1 = none) */
+static struct timeval step_start;
+static ControlCameraHandler camera_handler = NULL;
+
+/* Tunable parameters by name */
+static struct {
+	const char *name;
+	float *value;
+} params[] = {
+	{"vmix", &sim_params.vmix},
+	{"center_force", &sim_params.center_force},
+	{"base_radius", &sim_params.base_radius},
+	{"collision_force", &sim_params.collision_force},
+	{"max_dist_sq", &sim_params.max_dist_sq},
+	{"force_scale", &sim_params.force_scale}
+};
+#define NUM_PARAMS ((int)(sizeof(params) / sizeof(params[0])))
+
+/* Write as much queued output as the socket takes - control_mutex held */
+static void flush_output(void) {
+	int n;
+	
+	while (output_len > 0) {
+		n = write(client_fd, output, output_len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) return;
+		if (n <= 0) {
+			/* The server thread notices the closed connection on its next read */
+			output_len = 0;
+			return;
+		}
+		memmove(output, output + n, output_len - n);
+		output_len -= n;
+	}
+}
+
+/* Send a line to the connected client. Lines are never split: a client that
+ * stops reading until the output buffer is full is disconnected instead. */
+static void control_send(const char *line) {
+	int len;
+	
+	len = strlen(line);
+	pthread_mutex_lock(&control_mutex);
+	if (client_fd >= 0) {
+		if (output_len + len > CONTROL_OUTPUT_SIZE) {
+			/* The server thread closes the connection on its next read */
+			shutdown(client_fd, SHUT_RDWR);
+			output_len = 0;
+		} else {
+			memcpy(output + output_len, line, len);
+			output_len += len;
+			flush_output();
+		}
+	}
+	pthread_mutex_unlock(&control_mutex);
+}
+
+static void control_reply(const char *status, const char *detail) {
+	char line[CONTROL_LINE_SIZE + 32];
+	
+	sprintf(line, "%s %.*s\n", status, CONTROL_LINE_SIZE - 1, detail);
+	control_send(line);
+}
+
+/* Queue one received line - called by the server thread */
+static void enqueue_command(const char *line) {
+	int full;
+	
+	pthread_mutex_lock(&control_mutex);
+	full = queue_count == CONTROL_QUEUE_SIZE;
+	if (!full) {
+		strncpy(queue[(queue_head + queue_count) % CONTROL_QUEUE_SIZE], line, CONTROL_LINE_SIZE - 1);
+		queue[(queue_head + queue_count) % CONTROL_QUEUE_SIZE][CONTROL_LINE_SIZE - 1] = '\0';
+		queue_count++;
+	}
+	pthread_mutex_unlock(&control_mutex);
+	
+	if (full) {
+		control_reply("error", "queue full");
+	}
+}
+
+static void close_client(void) {
+	pthread_mutex_lock(&control_mutex);
+	if (client_fd >= 0) {
+		close(client_fd);
+		client_fd = -1;
+		output_len = 0;
+	}
+	pthread_mutex_unlock(&control_mutex);
+}
+
+static void* control_server(void *arg) {
+	char buffer[CONTROL_LINE_SIZE];
+	int buffer_len, fd, max_fd, n, i, start;
+	fd_set fds, write_fds;
+	struct timeval timeout;
+	
+	(void)arg;
+	buffer_len = 0;
+	
+	while (server_running) {
+		FD_ZERO(&fds);
+		FD_ZERO(&write_fds);
+		FD_SET(listen_fd, &fds);
+		max_fd = listen_fd;
+		pthread_mutex_lock(&control_mutex);
+		if (client_fd >= 0) {
+			FD_SET(client_fd, &fds);
+			if (output_len > 0) FD_SET(client_fd, &write_fds);
+			if (client_fd > max_fd) max_fd = client_fd;
+		}
+		pthread_mutex_unlock(&control_mutex);
+		
+		/* Short timeout so control_stop() does not have to wake us */
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 200000;
+		if (select(max_fd + 1, &fds, &write_fds, NULL, &timeout) <= 0) continue;
+		
+		if (client_fd >= 0 && FD_ISSET(client_fd, &write_fds)) {
+			pthread_mutex_lock(&control_mutex);
+			flush_output();
+			pthread_mutex_unlock(&control_mutex);
+		}
+		
+		if (FD_ISSET(listen_fd, &fds)) {
+			fd = accept(listen_fd, NULL, NULL);
+			if (fd >= 0) {
+				if (client_fd >= 0) {
+					/* One client at a time */
+					if (write(fd, "error busy\n", 11) < 0) {
+						/* Nothing to do, the connection is closed anyway */
+					}
+					close(fd);
+				} else {
+					/* Non-blocking so a stalled client can never block a step */
+					fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+					pthread_mutex_lock(&control_mutex);
+					client_fd = fd;
+					pthread_mutex_unlock(&control_mutex);
+					buffer_len = 0;
+					control_reply("ok", "particle_life control");
+				}
+			}
+		}
+		
+		if (client_fd >= 0 && FD_ISSET(client_fd, &fds)) {
+			n = read(client_fd, buffer + buffer_len, sizeof(buffer) - 1 - buffer_len);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+				close_client();
+				continue;
+			}
+			if (n < 0) continue;
+			buffer_len += n;
+			
+			/* Split complete lines */
+			start = 0;
+			for (i = 0; i < buffer_len; i++) {
+				if (buffer[i] == '\n' || buffer[i] == '\r') {
+					buffer[i] = '\0';
+					if (i > start) enqueue_command(buffer + start);
+					start = i + 1;
+				}
+			}
+			
+			if (start == 0 && buffer_len == (int)sizeof(buffer) - 1) {
+				control_reply("error", "line too long");
+				buffer_len = 0;
+			} else {
+				memmove(buffer, buffer + start, buffer_len - start);
+				buffer_len -= start;
+			}
+		}
+	}
+	
+	return NULL;
+}
+
+int control_start(const char *socket_path) {
+	struct sockaddr_un address;
+	
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		printf("ERROR: Control socket path too long: %s\n", socket_path);
+		return -1;
+	}
+	
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		printf("ERROR: Could not create control socket\n");
+		return -1;
+	}
+	
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	strcpy(socket_file, socket_path);
+	
+	/* Remove a stale socket left by an earlier run */
+	unlink(socket_path);
+	
+	if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+		listen(listen_fd, 1) != 0) {
+		printf("ERROR: Could not bind control socket %s\n", socket_path);
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+	
+	/* Writes to a client that has gone away must not kill the run */
+	signal(SIGPIPE, SIG_IGN);
+	
+	server_running = 1;
+	if (pthread_create(&server_thread, NULL, control_server, NULL) != 0) {
+		printf("ERROR: Could not create control thread\n");
+		server_running = 0;
+		close(listen_fd);
+		listen_fd = -1;
+		unlink(socket_file);
+		return -1;
+	}
+	
+	printf("Control socket listening on %s\n", socket_path);
+	return 0;
+}
+
+void control_set_camera_handler(ControlCameraHandler handler) {
+	camera_handler = handler;
+}
+
+/* Apply one command - main thread, between steps */
+static void apply_command(char *line) {
+	char name[CONTROL_LINE_SIZE], reply[CONTROL_LINE_SIZE + 32];
+	char *command, *args;
+	float value, x, y, z, x1, y1, z1;
+	long steps;
+	int i, j, written;
+	
+	command = strtok(line, " \t");
+	if (!command) return;
+	args = strtok(NULL, "");
+	if (!args) args = "";
+	
+	if (strcmp(command, "pause") == 0) {
+		paused = 1;
+		step_credit = 0;
+		control_reply("ok", "paused");
+	} else if (strcmp(command, "resume") == 0) {
+		paused = 0;
+		step_credit = 0;
+		control_reply("ok", "running");
+	} else if (strcmp(command, "step") == 0) {
+		if (sscanf(args, "%ld", &steps) != 1) steps = 1;
+		if (steps < 1) {
+			control_reply("error", "step count must be positive");
+			return;
+		}
+		paused = 1;
+		step_credit += steps;
+		sprintf(reply, "stepping %ld", steps);
+		control_reply("ok", reply);
+	} else if (strcmp(command, "set") == 0) {
+		if (sscanf(args, "%255s %f", name, &value) != 2) {
+			control_reply("error", "usage: set NAME VALUE");
+			return;
+		}
+		for (i = 0; i < NUM_PARAMS; i++) {
+			if (strcmp(params[i].name, name) == 0) {
+				*params[i].value = value;
+				sprintf(reply, "%s %g", name, value);
+				control_reply("ok", reply);
+				return;
+			}
+		}
+		control_reply("error", "unknown parameter");
+	} else if (strcmp(command, "get") == 0) {
+		for (i = 0; i < NUM_PARAMS; i++) {
+			sprintf(reply, "%s %g", params[i].name, *params[i].value);
+			control_reply("param", reply);
+		}
+		sprintf(reply, "particles %d", total_particles);
+		control_reply("ok", reply);
+	} else if (strcmp(command, "attract") == 0) {
+		if (sscanf(args, "%d %d %f", &i, &j, &value) != 3 ||
+			i < 0 || i >= NUM_TYPES || j < 0 || j >= NUM_TYPES) {
+			control_reply("error", "usage: attract I J VALUE");
+			return;
+		}
+		attraction[i][j] = value;
+		sprintf(reply, "attract %d %d %g", i, j, value);
+		control_reply("ok", reply);
+	} else if (strcmp(command, "count") == 0) {
+		if (sscanf(args, "%d", &i) != 1 || i < 0 || i > CONTROL_MAX_PARTICLES) {
+			sprintf(reply, "usage: count N (0 to %d)", CONTROL_MAX_PARTICLES);
+			control_reply("error", reply);
+			return;
+		}
+		set_particle_count(i);
+		sprintf(reply, "count %d", total_particles);
+		control_reply("ok", reply);
+	} else if (strcmp(command, "spawn") == 0) {
+		written = sscanf(args, "%d %f %f %f %d", &i, &x, &y, &z, &j);
+		if (written < 4 || i < 0 || i >= NUM_TYPES) {
+			control_reply("error", "usage: spawn TYPE X Y Z [N]");
+			return;
+		}
+		if (written == 4) j = 1;
+		if (j < 1 || j > CONTROL_MAX_PARTICLES) {
+			sprintf(reply, "spawn count must be 1 to %d", CONTROL_MAX_PARTICLES);
+			control_reply("error", reply);
+			return;
+		}
+		for (written = 0; written < j; written++) {
+			if (spawn_particle(x, y, z, i) < 0) break;
+		}
+		sprintf(reply, "spawned %d", written);
+		control_reply("ok", reply);
+	} else if (strcmp(command, "remove") == 0) {
+		if (sscanf(args, "%d", &i) != 1) {
+			control_reply("error", "usage: remove ID");
+			return;
+		}
+		sprintf(reply, "removed %d", remove_particle(i));
+		control_reply("ok", reply);
+	} else if (strcmp(command, "removetype") == 0) {
+		if (sscanf(args, "%d %d", &i, &j) != 2) {
+			control_reply("error", "usage: removetype TYPE N");
+			return;
+		}
+		sprintf(reply, "removed %d", remove_particles_of_type(i, j));
+		control_reply("ok", reply);
+	} else if (strcmp(command, "removeregion") == 0) {
+		if (sscanf(args, "%f %f %f %f %f %f", &x, &y, &z, &x1, &y1, &z1) != 6) {
+			control_reply("error", "usage: removeregion X0 Y0 Z0 X1 Y1 Z1");
+			return;
+		}
+		sprintf(reply, "removed %d", remove_particles_in_region(x, y, z, x1, y1, z1));
+		control_reply("ok", reply);
+	} else if (strcmp(command, "reset") == 0) {
+		init_grid_with_particles();
+		control_reply("ok", "reset");
+	} else if (strcmp(command, "snapshot") == 0) {
+		if (sscanf(args, "%255s", name) != 1) {
+			control_reply("error", "usage: snapshot FILE");
+			return;
+		}
+		written = write_snapshot(name);
+		if (written < 0) {
+			control_reply("error", "could not write snapshot");
+			return;
+		}
+		sprintf(reply, "snapshot %d particles", written);
+		control_reply("ok", reply);
+	} else if (strcmp(command, "stats") == 0) {
+		stream_stats = strncmp(args, "on", 2) == 0;
+		control_reply("ok", stream_stats ? "stats on" : "stats off");
+	} else if (strcmp(command, "clusters") == 0) {
+		if (sscanf(args, "%d", &i) != 1 || i < 0) {
+			control_reply("error", "usage: clusters N");
+			return;
+		}
+		cluster_interval = i;
+		sprintf(reply, "clusters every %d steps", cluster_interval);
+		control_reply("ok", reply);
+	} else if (strcmp(command, "camera") == 0) {
+		if (!camera_handler) {
+			control_reply("error", "no camera in this mode");
+			return;
+		}
+		if (sscanf(args, "%f %f %f", &x, &y, &z) != 3) {
+			control_reply("error", "usage: camera X Y Z");
+			return;
+		}
+		camera_handler(x, y, z);
+		control_reply("ok", "camera");
+	} else if (strcmp(command, "quit") == 0) {
+		quit_requested = 1;
+		control_reply("ok", "quit");
+	} else {
+		control_reply("error", "unknown command");
+	}
+}
+
+/* Apply queued commands and decide whether to run the next step */
+int control_begin_step(void) {
+	char line[CONTROL_LINE_SIZE];
+	int have_line;
+	
+	if (!server_running) return CONTROL_RUN;
+	
+	for (;;) {
+		pthread_mutex_lock(&control_mutex);
+		have_line = queue_count > 0;
+		if (have_line) {
+			strcpy(line, queue[queue_head]);
+			queue_head = (queue_head + 1) % CONTROL_QUEUE_SIZE;
+			queue_count--;
+		}
+		pthread_mutex_unlock(&control_mutex);
+		
+		if (!have_line) break;
+		apply_command(line);
+	}
+	
+	if (quit_requested) return CONTROL_QUIT;
+	
+	if (paused) {
+		if (step_credit == 0) return CONTROL_IDLE;
+		step_credit--;
+		stepping = 1;
+	}
+	
+	gettimeofday(&step_start, NULL);
+	return CONTROL_RUN;
+}
+
+/* Stream the stats of the step that just finished */
+void control_end_step(void) {
+	struct timeval now;
+	char line[CONTROL_LINE_SIZE];
+	double step_ms;
+	
+	if (!server_running) return;
+	
+	steps_done++;
+	
+	if (stream_stats) {
+		gettimeofday(&now, NULL);
+		step_ms = (now.tv_sec - step_start.tv_sec) * 1000.0 +
+				  (now.tv_usec - step_start.tv_usec) / 1000.0;
+		sprintf(line, "stats step %ld particles %d step_ms %.3f\n",
+				steps_done, total_particles, step_ms);
+		control_send(line);
+		
+		if (cluster_stats.valid && cluster_stats.step != cluster_step_sent) {
+			cluster_step_sent = cluster_stats.step;
+			sprintf(line, "clusters step %ld count %d largest %d clustered %d ms %.3f\n",
+					cluster_stats.step, cluster_stats.clusters, cluster_stats.largest,
+					cluster_stats.clustered, cluster_stats.usec / 1000.0);
+			control_send(line);
+		}
+	}
+	
+	/* Tell a "step N" client when its steps are done */
+	if (paused && step_credit == 0 && stepping) {
+		stepping = 0;
+		sprintf(line, "done step %ld\n", steps_done);
+		control_send(line);
+	}
+}
+
+void control_stop(void) {
+	if (!server_running) return;
+	
+	server_running = 0;
+	pthread_join(server_thread, NULL);
+	
+	close_client();
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(socket_file);
+}
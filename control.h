@@ -0,0 +1,19 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/* Return values of control_begin_step() */
+#define CONTROL_IDLE 0   /* Paused - do not advance the simulation */
+#define CONTROL_RUN  1   /* Advance one step */
+#define CONTROL_QUIT -1  /* A client asked the program to exit */
+
+/* Camera changes are forwarded to the front end, which owns the view */
+typedef void (*ControlCameraHandler)(float x, float y, float z);
+
+/* Functions */
+int control_start(const char *socket_path);
+void control_set_camera_handler(ControlCameraHandler handler);
+int control_begin_step(void);
+void control_end_step(void);
+void control_stop(void);
+
+#endif
@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <Xm/Frame.h>  
 #include <X11/GLw/GLwMDrawA.h>
 #include <X11/keysym.h>
@@ -12,16 +13,40 @@
 #include <GL/glu.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
 #include "simulation.h"
+#include "control.h"
+#include "clusters.h"
 
 /* GUI variables */
 static Widget toplevel_widget, glx_widget;
 static float camera_x = 2.0f, camera_y = 1.5f, camera_z = 2.5f;
 
+/* Run options */
+static int headless = 0;
+static const char *control_path = NULL;
+
 /* SGI Octane MXI optimizations */
 static GLuint wireframe_display_list = 0;
 static int use_display_lists = 1;
 
+/* View frustum culling and level of detail */
+#define POINT_SIZE 4.0f         /* Particles and aggregated cells alike */
+#define LOD_DENSE_CELL 64       /* Particles a cell needs to be aggregated at LOD_DISTANCE; */
+#define LOD_DISTANCE 3.2f       /* the threshold falls with the square of the camera distance */
+static float frustum[6][4];     /* Clip planes (a, b, c, d) extracted from GL matrices */
+static int use_lod = 0;
+static int drawn_points = 0;    /* Points submitted in the last frame */
+
+/* Bounding box of a grid cell along Z - the 2D world is the z = 0 plane */
+#if SIM_DIMS == 3
+#define CELL_MIN_Z(gz) (-1.0f + (gz) * CELL_SIZE)
+#define CELL_DEPTH CELL_SIZE
+#else
+#define CELL_MIN_Z(gz) 0.0f
+#define CELL_DEPTH 0.0f
+#endif
+
 /* FPS counter */
 static void update_fps_title(void) {
 	static int frame_count = 0;
@@ -29,7 +54,6 @@ static void update_fps_title(void) {
 	static float current_fps = 0.0f;
 	char title_buffer[100];
 	time_t current_time;
-	int gx, gy, gz;
 	int total_particles;
 	
 	total_particles = 0;
@@ -42,16 +66,10 @@ static void update_fps_title(void) {
 		last_time = current_time;
 		
 		/* Count total particles directly from grid */
-		for (gx = 0; gx < GRID_SIZE; gx++) {
-			for (gy = 0; gy < GRID_SIZE; gy++) {
-				for (gz = 0; gz < GRID_SIZE; gz++) {
-					total_particles += grid[gx][gy][gz].count;
-				}
-			}
-		}
+		total_particles = count_particles();
 		
-		sprintf(title_buffer, "Particle Life SGI - FPS: %.1f - Particles: %d", 
-				current_fps, total_particles);
+		sprintf(title_buffer, "Particle Life SGI - FPS: %.1f - Particles: %d - Drawn: %d%s", 
+				current_fps, total_particles, drawn_points, use_lod ? " (LOD)" : "");
 		XtVaSetValues(toplevel_widget, XmNtitle, title_buffer, NULL);
 	} else if (last_time == 0) {
 		last_time = current_time;
@@ -70,6 +88,7 @@ static void create_wireframe_display_list(void) {
 	wireframe_display_list = glGenLists(1);
 	glNewList(wireframe_display_list, GL_COMPILE);
 	
+#if SIM_DIMS == 3
 	/* Wireframe cube */
 	glColor3f(0.2f, 0.2f, 0.3f);
 	glBegin(GL_LINES);
@@ -103,49 +122,168 @@ static void create_wireframe_display_list(void) {
 		glVertex3f(1.0f, -1.0f, pos);
 	}
 	glEnd();
+#else
+	/* Border of the plane */
+	glColor3f(0.2f, 0.2f, 0.3f);
+	glBegin(GL_LINE_LOOP);
+	glVertex3f(-1.0f, -1.0f, 0.0f);
+	glVertex3f(1.0f, -1.0f, 0.0f);
+	glVertex3f(1.0f, 1.0f, 0.0f);
+	glVertex3f(-1.0f, 1.0f, 0.0f);
+	glEnd();
+	
+	/* Grid in the plane */
+	glColor3f(0.15f, 0.15f, 0.25f);
+	glBegin(GL_LINES);
+	for (i = -1; i <= 1; i++) {
+		pos = i * 0.5f;
+		glVertex3f(pos, -1.0f, 0.0f);
+		glVertex3f(pos, 1.0f, 0.0f);
+		glVertex3f(-1.0f, pos, 0.0f);
+		glVertex3f(1.0f, pos, 0.0f);
+	}
+	glEnd();
+#endif
 	
 	glEndList();
 }
 
-/* SGI MXI-optimized particle rendering */
+/* Extract the six clip planes from the current projection * modelview matrix
+ * (Gribb/Hartmann). Call whenever gluLookAt or gluPerspective changes. */
+static void update_frustum(void) {
+	GLfloat mv[16], proj[16], clip[16];
+	float length;
+	int row, col, p;
+	
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	glGetFloatv(GL_PROJECTION_MATRIX, proj);
+	
+	/* OpenGL matrices are column-major: element (row, col) is m[col * 4 + row] */
+	for (col = 0; col < 4; col++) {
+		for (row = 0; row < 4; row++) {
+			clip[col * 4 + row] = proj[0 * 4 + row] * mv[col * 4 + 0] +
+								  proj[1 * 4 + row] * mv[col * 4 + 1] +
+								  proj[2 * 4 + row] * mv[col * 4 + 2] +
+								  proj[3 * 4 + row] * mv[col * 4 + 3];
+		}
+	}
+	
+	/* Left/right, bottom/top, near/far = row 3 +/- row 0, 1, 2 */
+	for (p = 0; p < 6; p++) {
+		row = p / 2;
+		for (col = 0; col < 4; col++) {
+			if (p % 2 == 0) {
+				frustum[p][col] = clip[col * 4 + 3] + clip[col * 4 + row];
+			} else {
+				frustum[p][col] = clip[col * 4 + 3] - clip[col * 4 + row];
+			}
+		}
+		
+		length = sqrt(frustum[p][0] * frustum[p][0] +
+					  frustum[p][1] * frustum[p][1] +
+					  frustum[p][2] * frustum[p][2]);
+		for (col = 0; col < 4; col++) {
+			frustum[p][col] /= length;
+		}
+	}
+}
+
+/* Test a grid cell's bounding box against the view frustum */
+static int cell_in_frustum(float min_x, float min_y, float min_z, float size, float depth) {
+	float px, py, pz;
+	int p;
+	
+	for (p = 0; p < 6; p++) {
+		/* Corner farthest along the plane normal - if it is outside, the whole box is */
+		px = frustum[p][0] >= 0.0f ? min_x + size : min_x;
+		py = frustum[p][1] >= 0.0f ? min_y + size : min_y;
+		pz = frustum[p][2] >= 0.0f ? min_z + depth : min_z;
+		
+		if (frustum[p][0] * px + frustum[p][1] * py + frustum[p][2] * pz + frustum[p][3] < 0.0f) {
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/* SGI MXI-optimized particle rendering with per-cell culling and LOD */
 static void draw_particles_optimized(void) {
-	int gx, gy, gz, i;
+	int c, num_cells, gx, gy, gz, i, t;
+	int type_counts[NUM_TYPES];
 	float dx, dy, dz, camera_distance_sq;
+	float min_x, min_y, min_z;
+	float sum_x, sum_y, sum_z;
+	float r, g, b;
 	float brightness;
+	GridCell *cell;
 	Cell *current_particle;
 	
+	drawn_points = 0;
+	num_cells = grid_cell_count();
+	
 	/* Direct rendering without vertex arrays - faster for SGI MXI */
-	glPointSize(4.0f);
+	glPointSize(POINT_SIZE);
 	glBegin(GL_POINTS);
 	
-	for (gx = 0; gx < GRID_SIZE; gx++) {
-		for (gy = 0; gy < GRID_SIZE; gy++) {
-			for (gz = 0; gz < GRID_SIZE; gz++) {
-				for (i = 0; i < grid[gx][gy][gz].count; i++) {
-					current_particle = &grid[gx][gy][gz].particles[i];
-					
-					/* Fast frustum culling */
-					if (current_particle->x < -1.2f || current_particle->x > 1.2f ||
-						current_particle->y < -1.2f || current_particle->y > 1.2f ||
-						current_particle->z < -1.2f || current_particle->z > 1.2f) {
-						continue;
-					}
-					
-					/* Fast brightness without sqrt */
-					dx = current_particle->x - camera_x;
-					dy = current_particle->y - camera_y;
-					dz = current_particle->z - camera_z;
-					camera_distance_sq = dx*dx + dy*dy + dz*dz;
-					
-					brightness = (camera_distance_sq < 9.0f) ? 1.0f : 0.7f;
-					
-					glColor3f(colors[current_particle->type][0] * brightness,
-							  colors[current_particle->type][1] * brightness,
-							  colors[current_particle->type][2] * brightness);
-					glVertex3f(current_particle->x, current_particle->y, current_particle->z);
-				}
+	for (c = 0; c < num_cells; c++) {
+		cell = grid_cell(c, &gx, &gy, &gz);
+		min_x = -1.0f + gx * CELL_SIZE;
+		min_y = -1.0f + gy * CELL_SIZE;
+		min_z = CELL_MIN_Z(gz);
+		
+		if (cell->count == 0) continue;
+		
+		/* Frustum culling per grid cell */
+		if (!cell_in_frustum(min_x, min_y, min_z, CELL_SIZE, CELL_DEPTH)) continue;
+		
+		/* Fast brightness without sqrt - one value for the whole cell */
+		dx = min_x + 0.5f * CELL_SIZE - camera_x;
+		dy = min_y + 0.5f * CELL_SIZE - camera_y;
+		dz = min_z + 0.5f * CELL_DEPTH - camera_z;
+		camera_distance_sq = dx*dx + dy*dy + dz*dz;
+		
+		brightness = (camera_distance_sq < 9.0f) ? 1.0f : 0.7f;
+		
+		/* Crowded for its distance: one color-weighted point at its centroid.
+		 * Only worth it when that replaces several points. */
+		if (use_lod && cell->count > 1 &&
+			cell->count * camera_distance_sq > LOD_DENSE_CELL * LOD_DISTANCE * LOD_DISTANCE) {
+			sum_x = sum_y = sum_z = 0.0f;
+			for (t = 0; t < NUM_TYPES; t++) {
+				type_counts[t] = 0;
 			}
+			for (i = 0; i < cell->count; i++) {
+				current_particle = &cell->particles[i];
+				sum_x += current_particle->x;
+				sum_y += current_particle->y;
+				sum_z += CELL_Z(current_particle);
+				type_counts[current_particle->type]++;
+			}
+			
+			r = g = b = 0.0f;
+			for (t = 0; t < NUM_TYPES; t++) {
+				r += colors[t][0] * type_counts[t];
+				g += colors[t][1] * type_counts[t];
+				b += colors[t][2] * type_counts[t];
+			}
+			glColor3f(r * brightness / cell->count,
+					  g * brightness / cell->count,
+					  b * brightness / cell->count);
+			glVertex3f(sum_x / cell->count, sum_y / cell->count, sum_z / cell->count);
+			drawn_points++;
+			continue;
+		}
+		
+		for (i = 0; i < cell->count; i++) {
+			current_particle = &cell->particles[i];
+			
+			glColor3f(colors[current_particle->type][0] * brightness,
+					  colors[current_particle->type][1] * brightness,
+					  colors[current_particle->type][2] * brightness);
+			glVertex3f(current_particle->x, current_particle->y, CELL_Z(current_particle));
 		}
+		drawn_points += cell->count;
 	}
 	
 	glEnd();
@@ -190,12 +328,39 @@ static void game_loop(XtPointer client_data, XtIntervalId *id) {
 	/* Avoid unused parameter warnings */
 	(void)id;
 	
-	update_particles();
+	switch (control_begin_step()) {
+		case CONTROL_QUIT:
+			control_stop();
+			exit(0);
+			break;
+		case CONTROL_RUN:
+			update_particles();
+			control_end_step();
+			break;
+	}
 	draw_scene();
 	/* 16ms = ~60 FPS instead of 33ms = 30 FPS */
 	XtAppAddTimeOut((XtAppContext)client_data, 16, game_loop, client_data);
 }
 
+/* Load the modelview matrix for the current camera position */
+static void apply_camera(void) {
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	gluLookAt(camera_x, camera_y, camera_z,
+		  0.0f, 0.0f, 0.0f,
+		  0.0f, 1.0f, 0.0f);
+	update_frustum();
+}
+
+/* Camera changes from the control socket */
+static void control_camera(float x, float y, float z) {
+	camera_x = x;
+	camera_y = y;
+	camera_z = z;
+	apply_camera();
+}
+
 static void input(Widget w, XtPointer client_data, XtPointer call) {
 	char buffer[31];
 	KeySym keysym;
@@ -209,11 +374,15 @@ static void input(Widget w, XtPointer client_data, XtPointer call) {
 		XLookupString(&event->xkey, buffer, 30, &keysym, NULL);
 		switch(keysym) {
 			case XK_Escape:
+				control_stop();
 				exit(0);
 				break;
 			case XK_r:
 				init_grid_with_particles();
 				break;
+			case XK_l:
+				use_lod = !use_lod;
+				break;
 			case XK_Left:
 				camera_x -= 0.2f;
 				break;
@@ -234,11 +403,7 @@ static void input(Widget w, XtPointer client_data, XtPointer call) {
 				break;
 		}
 		
-		glMatrixMode(GL_MODELVIEW);
-		glLoadIdentity();
-		gluLookAt(camera_x, camera_y, camera_z,
-			  0.0f, 0.0f, 0.0f,
-			  0.0f, 1.0f, 0.0f);
+		apply_camera();
 	}
 }
 
@@ -261,6 +426,70 @@ static void expose(Widget w, XtPointer client_data, XtPointer call) {
 	draw_scene();
 }
 
+/* Parse simulation options left over after Xt has consumed its own */
+static void parse_options(int argc, char *argv[]) {
+	int i;
+	
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			num_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-nodes") == 0 && i + 1 < argc) {
+			numa_nodes = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-pin") == 0) {
+			thread_pinning = 1;
+		} else if (strcmp(argv[i], "-cpus-per-node") == 0 && i + 1 < argc) {
+			cpus_per_node = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-numastats") == 0 && i + 1 < argc) {
+			numa_report_interval = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-clusters") == 0 && i + 1 < argc) {
+			cluster_interval = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-linkdist") == 0 && i + 1 < argc) {
+			cluster_link_distance = (float)atof(argv[++i]);
+		} else if (strcmp(argv[i], "-control") == 0 && i + 1 < argc) {
+			control_path = argv[++i];
+		} else if (strcmp(argv[i], "-headless") == 0) {
+			headless = 1;
+		} else {
+			fprintf(stderr, "Usage: %s [-threads N] [-nodes N] [-pin] [-cpus-per-node N] [-numastats STEPS] "
+					"[-clusters STEPS] [-linkdist D] [-control SOCKET] [-headless]\n", argv[0]);
+			exit(1);
+		}
+	}
+}
+
+/* Simulation without a window, driven and observed through the control socket */
+static int run_headless(void) {
+	int state;
+	
+	srand(time(NULL));
+	init_grid_with_particles();
+	init_threads();
+	
+	if (control_path) {
+		control_start(control_path);
+	} else {
+		printf("Running headless without -control, stop with a signal\n");
+	}
+	
+	for (;;) {
+		state = control_begin_step();
+		if (state == CONTROL_QUIT) break;
+		
+		if (state == CONTROL_IDLE) {
+			/* Paused - poll for commands without spinning */
+			usleep(10000);
+			continue;
+		}
+		
+		update_particles();
+		control_end_step();
+	}
+	
+	control_stop();
+	cleanup_threads();
+	return 0;
+}
+
 static int attribs[] = {GLX_RGBA, GLX_DOUBLEBUFFER, GLX_DEPTH_SIZE, 16, None};
 static String fallbackResources[] = {
 	"*glxwidget*width: 800", "*glxwidget*height: 800",
@@ -274,11 +503,22 @@ int main(int argc, char *argv[]) {
 	XVisualInfo *visinfo;
 	GLXContext glxcontext;
 	Widget toplevel, frame, glxwidget;
+	int i;
+	
+	/* Headless runs must not open a display, so look for it before Xt does */
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-headless") == 0) headless = 1;
+	}
+	if (headless) {
+		parse_options(argc, argv);
+		return run_headless();
+	}
 
 	toplevel = XtOpenApplication(&app, "particle_life_sgi", NULL, 0, &argc,
 								argv, fallbackResources, applicationShellWidgetClass,
 								NULL, 0);
 	toplevel_widget = toplevel;
+	parse_options(argc, argv);
 
 	dpy = XtDisplay(toplevel);
 	frame = XmCreateFrame(toplevel, "frame", NULL, 0);
@@ -311,6 +551,7 @@ int main(int argc, char *argv[]) {
 	gluLookAt(camera_x, camera_y, camera_z,
 		  0.0f, 0.0f, 0.0f,
 		  0.0f, 1.0f, 0.0f);
+	update_frustum();
 	
 	/* SGI-specific optimizations */
 	glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_FASTEST);
@@ -324,6 +565,10 @@ int main(int argc, char *argv[]) {
 	init_grid_with_particles();
 	init_threads();
 	
+	if (control_path && control_start(control_path) == 0) {
+		control_set_camera_handler(control_camera);
+	}
+	
 	/* Longer initial delay for SGI initialization */
 	XtAppAddTimeOut(app, 200, game_loop, app);
 	XtAppMainLoop(app);
@@ -332,6 +577,7 @@ int main(int argc, char *argv[]) {
 	if (wireframe_display_list != 0) {
 		glDeleteLists(wireframe_display_list, 1);
 	}
+	control_stop();
 	cleanup_threads();
 	return 0;
 }
@@ -1,21 +1,60 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* pthread_setaffinity_np */
+#endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include <pthread.h>
 #include "simulation.h"
+#include "clusters.h"
 
 /* Global variables */
-GridCell grid[GRID_SIZE][GRID_SIZE][GRID_SIZE];
-GridCell work_grid[GRID_SIZE][GRID_SIZE][GRID_SIZE];
-GridCell temp_grid1[GRID_SIZE][GRID_SIZE][GRID_SIZE]; 
-GridCell temp_grid2[GRID_SIZE][GRID_SIZE][GRID_SIZE];
+#if !SPARSE_GRID
+GridCell grid[GRID_SIZE][GRID_SIZE][GRID_SIZE_Z];
+GridCell work_grid[GRID_SIZE][GRID_SIZE][GRID_SIZE_Z];
+GridCell *temp_grids[MAX_THREADS];  /* GRID_SIZE^2 * GRID_SIZE_Z cells each, NULL until used */
+#endif
 int total_particles = 720;
 
+/* Threading / NUMA options */
+int num_threads = 2;
+int numa_nodes = 1;
+int thread_pinning = 0;
+int cpus_per_node = 0;
+int numa_report_interval = 0;
+
+/* Structure for sending data to worker threads */
+typedef struct {
+	int thread_id;
+	int node;             /* NUMA node this worker belongs to */
+	int cpu;              /* CPU it is pinned to with -pin, on that node */
+	int slab_start;       /* First X plane owned by this worker */
+	int slab_end;         /* One past the last X plane owned by this worker */
+	int node_start;       /* X plane range owned by the whole node */
+	int node_end;
+	/* Per-thread statistics, only written by the owning thread */
+	double force_usec;    /* Time spent in the force/integration pass */
+	double merge_usec;    /* Time spent merging and swapping its slab */
+	long particles;       /* Particles integrated */
+	long exported;        /* Particles that moved into another node's region */
+	/* Neighbor buffer for process_cell(), sized to the stencil */
+	GridCell *neighbors;
+	int neighbor_capacity;
+} ThreadData;
+
 /* Pthread variables */
-static pthread_t thread1, thread2;
+static pthread_t threads[MAX_THREADS];
+static ThreadData thread_data[MAX_THREADS];
 static pthread_barrier_t barrier;
 static volatile int threads_running = 0;
+static volatile unsigned char rehome_planes[GRID_SIZE];  /* Plane memory was (re)allocated by the main thread */
+static volatile int cluster_pass = 0;    /* Run the cluster analysis during this step */
+static long step_count = 0;
+static long stats_steps = 0;             /* Steps covered by the current statistics */
 
 float colors[NUM_TYPES][3] = {
 	{0.3f, 1.0f, 0.3f},  /* Green */
@@ -26,8 +65,18 @@ float colors[NUM_TYPES][3] = {
 	{1.0f, 0.3f, 1.0f}   /* Magenta */
 };
 
+/* Physics parameters - reduced friction for more lively movements */
+SimParams sim_params = {
+	0.95f,   /* vmix */
+	0.05f,   /* center_force */
+	0.02f,   /* base_radius */
+	0.005f,  /* collision_force */
+	0.06f,   /* max_dist_sq - reduced from 0.09f for better performance */
+	0.005f   /* force_scale */
+};
+
 /* Attraction matrix - enhanced reactions on green particles */
-static float attraction[NUM_TYPES][NUM_TYPES] = {
+float attraction[NUM_TYPES][NUM_TYPES] = {
 	{ 0.85f, -0.70f,  0.95f, -0.50f, 0.75f, -0.80f},  /* Green: Strong self-attraction, flees red/blue/magenta, hunts yellow/cyan */
 	{-0.85f,  0.53f, -0.53f, -0.84f, -0.23f, 0.40f},  /* Red: Flees STRONGLY from green (was 0.17f) */
 	{-0.90f, -0.91f, -0.41f,  0.91f,  0.46f, -0.17f},  /* Yellow: Flees AGGRESSIVELY from green (was -0.40f) */
@@ -53,8 +102,10 @@ static void calc_periodic_distance(float x1, float y1, float z1, float x2, float
 	else if (*dy < -1.0f) *dy += 2.0f;
 	
 	/* Check wraparound for Z-axis */
+#if SIM_DIMS == 3
 	if (*dz > 1.0f) *dz -= 2.0f;
 	else if (*dz < -1.0f) *dz += 2.0f;
+#endif
 }
 
 /* Helper function to convert world coordinate to grid index */
@@ -65,6 +116,554 @@ static int coord_to_grid(float coord) {
 	return index;
 }
 
+/* Z grid index - the 2D grid is a single layer */
+#if SIM_DIMS == 3
+#define coord_to_grid_z(coord) coord_to_grid(coord)
+#else
+#define coord_to_grid_z(coord) 0
+#endif
+
+/* Grow an array to hold at least needed elements, 0 on success */
+static int reserve(void **array, int *capacity, int needed, size_t element_size) {
+	int new_capacity;
+	void *new_array;
+	
+	if (needed <= *capacity) return 0;
+	
+	new_capacity = *capacity == 0 ? 16 : *capacity;
+	while (new_capacity < needed) new_capacity *= 2;
+	new_array = realloc(*array, new_capacity * element_size);
+	if (!new_array) {
+		printf("CRITICAL ERROR: Could not allocate memory!\n");
+		return -1;
+	}
+	*array = new_array;
+	*capacity = new_capacity;
+	return 0;
+}
+
+/* Neighbor stencil: every cell that can hold a particle within the
+ * interaction cutoff of the center cell, so the force range does not
+ * depend on GRID_SIZE. Cells are grouped in rows along the last grid axis
+ * (Z, or Y in 2D) - row n covers the cells dx, dy, -reach..reach away.
+ * Rebuilt between steps whenever max_dist_sq changes. */
+typedef struct {
+	int dx;
+	int dy;       /* Always 0 in 2D */
+	int reach;    /* Cells on each side of the center along the row */
+} StencilRow;
+
+#if SIM_DIMS == 3
+#define STENCIL_DY (GRID_SIZE - 1)  /* Rows are spread over X and Y */
+#else
+#define STENCIL_DY 0                /* Rows are spread over X only */
+#endif
+
+static StencilRow *stencil = NULL;
+static int stencil_rows = 0;
+static int stencil_capacity = 0;
+static int stencil_slots = 0;          /* Most entries gather_neighbors() can return */
+static float stencil_dist_sq = -1.0f;  /* Cutoff the stencil was built for */
+
+/* Smallest distance between two cells d cells apart along one axis */
+static float cell_gap(int d) {
+	if (d < 0) d = -d;
+	return d > 1 ? (d - 1) * CELL_SIZE : 0.0f;
+}
+
+/* Widest row at offset (dx, dy) that still reaches within the cutoff, -1 if none */
+static int row_reach(int dx, int dy, float dist_sq) {
+	float gap_sq;
+	int reach;
+	
+	gap_sq = cell_gap(dx) * cell_gap(dx) + cell_gap(dy) * cell_gap(dy);
+	if (gap_sq > dist_sq) return -1;
+	
+	reach = 0;
+	while (reach < GRID_SIZE - 1 &&
+		   gap_sq + cell_gap(reach + 1) * cell_gap(reach + 1) <= dist_sq) {
+		reach++;
+	}
+	return reach;
+}
+
+/* Build the stencil for a squared cutoff - main thread, between steps.
+ * It always covers the surrounding cells. If memory runs out
+ * the old stencil is kept and the next step tries again. */
+static void update_stencil(float dist_sq) {
+	int dx, dy, reach, rows, cells;
+	
+	if (dist_sq == stencil_dist_sq) return;
+	
+	rows = 0;
+	for (dx = 1 - GRID_SIZE; dx < GRID_SIZE; dx++) {
+		for (dy = -STENCIL_DY; dy <= STENCIL_DY; dy++) {
+			if (row_reach(dx, dy, dist_sq) >= 0) rows++;
+		}
+	}
+	if (reserve((void**)&stencil, &stencil_capacity, rows, sizeof(StencilRow)) != 0) return;
+	
+	rows = 0;
+	cells = 0;
+	for (dx = 1 - GRID_SIZE; dx < GRID_SIZE; dx++) {
+		for (dy = -STENCIL_DY; dy <= STENCIL_DY; dy++) {
+			reach = row_reach(dx, dy, dist_sq);
+			if (reach < 0) continue;
+			stencil[rows].dx = dx;
+			stencil[rows].dy = dy;
+			stencil[rows].reach = reach;
+			rows++;
+			cells += 2 * reach + 1;
+		}
+	}
+	
+	stencil_rows = rows;
+	stencil_slots = SPARSE_GRID ? rows : cells;  /* The sparse grid returns one entry per row */
+	stencil_dist_sq = dist_sq;
+}
+
+static void free_stencil(void) {
+	free(stencil);
+	stencil = NULL;
+	stencil_rows = stencil_capacity = stencil_slots = 0;
+	stencil_dist_sq = -1.0f;
+}
+
+#if SPARSE_GRID
+/* Sparse grid. Every X plane keeps only its occupied cells: their keys
+ * (gy * GRID_SIZE_Z + gz) in ascending order, one GridCell each pointing into
+ * the plane's particle array, and an open addressing hash table from key to
+ * cell. Workers collect moved particles per destination plane instead of in
+ * a dense temporary grid, and the owner of a plane rebuilds it from those
+ * lists. Memory and per-step work follow the occupied cells, not the volume. */
+typedef struct {
+	int count;
+	int capacity;
+	Cell *particles;
+} CellList;
+
+typedef struct {
+	int num_cells;
+	int key_capacity;
+	int cell_capacity;
+	int *keys;             /* Key of every occupied cell, ascending */
+	GridCell *cells;       /* Views into particles, capacity == count */
+	int table_size;        /* Slots in use, a power of two (0 = empty plane) */
+	int table_capacity;
+	int *table;            /* Cell index per slot, -1 = free */
+	CellList particles;    /* All particles of the plane, cell by cell */
+} Plane;
+
+/* Scratch space for rebuilding a plane, one per worker plus the main thread */
+typedef struct {
+	int key;
+	int cell;
+} CellKey;
+
+typedef struct {
+	int particle_capacity;
+	int count_capacity;
+	int rank_capacity;
+	int order_capacity;
+	int *cell_of;          /* Cell of every gathered particle, in arrival order */
+	int *cell_count;       /* Particles per cell, then the write position */
+	int *rank;             /* Arrival order of a cell -> position in key order */
+	CellKey *order;
+} MergeScratch;
+
+static Plane grid_planes[GRID_SIZE];
+static Plane work_planes[GRID_SIZE];
+static CellList bins[MAX_THREADS][GRID_SIZE];  /* Moved particles per worker and destination plane */
+static CellList pending[GRID_SIZE];             /* Spawned since the planes were last rebuilt */
+static MergeScratch merge_scratch[MAX_THREADS + 1];
+static int plane_first[GRID_SIZE + 1];          /* Index of the first cell of every plane */
+static int index_dirty = 1;                     /* pending or plane_first are out of date */
+
+#define MAIN_SCRATCH MAX_THREADS
+
+static int add_particle_to_list(CellList *list, const Cell *particle) {
+	int new_capacity;
+	Cell *new_particles;
+	
+	if (list->count >= list->capacity) {
+		new_capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+		new_particles = (Cell*)realloc(list->particles, new_capacity * sizeof(Cell));
+		if (!new_particles) {
+			printf("CRITICAL ERROR: Could not allocate memory!\n");
+			return -1;
+		}
+		list->particles = new_particles;
+		list->capacity = new_capacity;
+	}
+	
+	list->particles[list->count++] = *particle;
+	return 0;
+}
+
+static int plane_key(const Cell *particle) {
+	return coord_to_grid(particle->y) * GRID_SIZE_Z + coord_to_grid_z(CELL_Z(particle));
+}
+
+/* Integer mix, so neighboring keys spread over the low bits used as the slot */
+static unsigned int hash_key(int key) {
+	unsigned int h = (unsigned int)key;
+	
+	h ^= h >> 16;
+	h *= 0x45d9f3bu;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Index of the cell with the given key in a plane, -1 if it is empty */
+static int plane_lookup(const Plane *plane, int key) {
+	unsigned int slot, mask;
+	int cell;
+	
+	if (plane->table_size == 0) return -1;
+	
+	mask = (unsigned int)plane->table_size - 1;
+	for (slot = hash_key(key) & mask; ; slot = (slot + 1) & mask) {
+		cell = plane->table[slot];
+		if (cell < 0) return -1;
+		if (plane->keys[cell] == key) return cell;
+	}
+}
+
+static int compare_cell_keys(const void *a, const void *b) {
+	return ((const CellKey*)a)->key - ((const CellKey*)b)->key;
+}
+
+/* Rebuild a plane from lists of particles that belong to it. Particles keep
+ * their order within a cell: list by list, in list order - the same order
+ * the dense grid's merge produces. */
+static void build_plane(Plane *plane, CellList *const *sources, int num_sources, MergeScratch *scratch) {
+	int n, s, i, j, k, r, cell, key, offset, table_size;
+	unsigned int slot, mask;
+	const Cell *particle;
+	
+	plane->num_cells = 0;
+	plane->particles.count = 0;
+	plane->table_size = 0;
+	
+	n = 0;
+	for (s = 0; s < num_sources; s++) {
+		n += sources[s]->count;
+	}
+	if (n == 0) return;
+	
+	/* At most one cell per particle; the table is kept at most half full */
+	table_size = 16;
+	while (table_size < 2 * n) table_size *= 2;
+	
+	if (reserve((void**)&plane->particles.particles, &plane->particles.capacity, n, sizeof(Cell)) != 0 ||
+		reserve((void**)&plane->keys, &plane->key_capacity, n, sizeof(int)) != 0 ||
+		reserve((void**)&plane->cells, &plane->cell_capacity, n, sizeof(GridCell)) != 0 ||
+		reserve((void**)&plane->table, &plane->table_capacity, table_size, sizeof(int)) != 0 ||
+		reserve((void**)&scratch->cell_of, &scratch->particle_capacity, n, sizeof(int)) != 0 ||
+		reserve((void**)&scratch->cell_count, &scratch->count_capacity, n, sizeof(int)) != 0 ||
+		reserve((void**)&scratch->rank, &scratch->rank_capacity, n, sizeof(int)) != 0 ||
+		reserve((void**)&scratch->order, &scratch->order_capacity, n, sizeof(CellKey)) != 0) {
+		return;  /* The particles of this plane are lost */
+	}
+	
+	plane->table_size = table_size;
+	mask = (unsigned int)table_size - 1;
+	for (slot = 0; slot < (unsigned int)table_size; slot++) {
+		plane->table[slot] = -1;
+	}
+	
+	/* Find or add the cell of every particle, cells numbered by first arrival */
+	k = 0;
+	i = 0;
+	for (s = 0; s < num_sources; s++) {
+		for (j = 0; j < sources[s]->count; j++) {
+			key = plane_key(&sources[s]->particles[j]);
+			for (slot = hash_key(key) & mask; ; slot = (slot + 1) & mask) {
+				cell = plane->table[slot];
+				if (cell < 0) {
+					cell = plane->table[slot] = k;
+					scratch->order[k].key = key;
+					scratch->order[k].cell = k;
+					scratch->cell_count[k] = 0;
+					k++;
+					break;
+				}
+				if (scratch->order[cell].key == key) break;
+			}
+			scratch->cell_of[i++] = cell;
+			scratch->cell_count[cell]++;
+		}
+	}
+	
+	/* Number the cells in key order and lay them out back to back */
+	qsort(scratch->order, k, sizeof(CellKey), compare_cell_keys);
+	offset = 0;
+	for (r = 0; r < k; r++) {
+		cell = scratch->order[r].cell;
+		scratch->rank[cell] = r;
+		plane->keys[r] = scratch->order[r].key;
+		plane->cells[r].count = plane->cells[r].capacity = scratch->cell_count[cell];
+		plane->cells[r].particles = plane->particles.particles + offset;
+		scratch->cell_count[cell] = offset;
+		offset += plane->cells[r].count;
+	}
+	for (slot = 0; slot < (unsigned int)table_size; slot++) {
+		if (plane->table[slot] >= 0) plane->table[slot] = scratch->rank[plane->table[slot]];
+	}
+	
+	/* Scatter the particles in arrival order */
+	i = 0;
+	for (s = 0; s < num_sources; s++) {
+		for (j = 0; j < sources[s]->count; j++) {
+			particle = &sources[s]->particles[j];
+			cell = scratch->cell_of[i++];
+			plane->particles.particles[scratch->cell_count[cell]++] = *particle;
+		}
+	}
+	
+	plane->num_cells = k;
+	plane->particles.count = n;
+}
+
+static void release_plane(Plane *plane) {
+	free(plane->keys);
+	free(plane->cells);
+	free(plane->table);
+	free(plane->particles.particles);
+	memset(plane, 0, sizeof(Plane));
+}
+
+/* Merge the particles spawned since the last rebuild into their planes and
+ * renumber the cells - main thread, between steps */
+static void sync_grid(void) {
+	CellList *sources[2];
+	Plane temp;
+	int gx;
+	
+	if (!index_dirty) return;
+	
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		if (pending[gx].count == 0) continue;
+		
+		sources[0] = &grid_planes[gx].particles;
+		sources[1] = &pending[gx];
+		build_plane(&work_planes[gx], sources, 2, &merge_scratch[MAIN_SCRATCH]);
+		pending[gx].count = 0;
+		
+		temp = grid_planes[gx];
+		grid_planes[gx] = work_planes[gx];
+		work_planes[gx] = temp;
+		rehome_planes[gx] = 1;  /* Rebuilt by the main thread */
+	}
+	
+	plane_first[0] = 0;
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		plane_first[gx + 1] = plane_first[gx] + grid_planes[gx].num_cells;
+	}
+	index_dirty = 0;
+}
+
+/* Insert a particle into the grid */
+static void place_particle(const Cell *particle, int gx, int gy, int gz) {
+	(void)gy;
+	(void)gz;
+	add_particle_to_list(&pending[gx], particle);
+	index_dirty = 1;
+}
+
+/* Empty every grid, keeping the buffers */
+static void clear_grids(void) {
+	int gx, t;
+	
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		grid_planes[gx].num_cells = work_planes[gx].num_cells = 0;
+		grid_planes[gx].particles.count = work_planes[gx].particles.count = 0;
+		grid_planes[gx].table_size = work_planes[gx].table_size = 0;
+		pending[gx].count = 0;
+		for (t = 0; t < MAX_THREADS; t++) {
+			bins[t][gx].count = 0;
+		}
+	}
+	index_dirty = 1;
+}
+
+static void free_grids(void) {
+	int gx, t;
+	
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		release_plane(&grid_planes[gx]);
+		release_plane(&work_planes[gx]);
+		free(pending[gx].particles);
+		memset(&pending[gx], 0, sizeof(CellList));
+		for (t = 0; t < MAX_THREADS; t++) {
+			free(bins[t][gx].particles);
+			memset(&bins[t][gx], 0, sizeof(CellList));
+		}
+	}
+	for (t = 0; t <= MAX_THREADS; t++) {
+		free(merge_scratch[t].cell_of);
+		free(merge_scratch[t].cell_count);
+		free(merge_scratch[t].rank);
+		free(merge_scratch[t].order);
+		memset(&merge_scratch[t], 0, sizeof(MergeScratch));
+	}
+	index_dirty = 1;
+}
+
+/* Forget the moved particles of one worker */
+static void clear_bins(int thread_id) {
+	int gx;
+	
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		bins[thread_id][gx].count = 0;
+	}
+}
+
+/* Hand a moved particle to the owner of its new cell */
+static void bin_particle(int thread_id, const Cell *particle, int gx, int gy, int gz) {
+	(void)gy;
+	(void)gz;
+	add_particle_to_list(&bins[thread_id][gx], particle);
+}
+
+/* STEP 4: Rebuild one plane from the particles every worker moved into it */
+static void merge_plane(int gx, int thread_id) {
+	CellList *sources[MAX_THREADS];
+	int t;
+	
+	for (t = 0; t < num_threads; t++) {
+		sources[t] = &bins[t][gx];
+	}
+	
+	/* Fresh buffers are allocated and first touched by this thread */
+	if (rehome_planes[gx]) {
+		release_plane(&work_planes[gx]);
+	}
+	build_plane(&work_planes[gx], sources, num_threads, &merge_scratch[thread_id]);
+	if (rehome_planes[gx]) {
+		release_plane(&grid_planes[gx]);
+	}
+}
+
+/* STEP 5: Swap one plane of grid and work grid */
+static void swap_plane(int gx) {
+	Plane temp;
+	
+	temp = grid_planes[gx];
+	grid_planes[gx] = work_planes[gx];
+	work_planes[gx] = temp;
+}
+
+/* First cell of a plane whose key is not below key */
+static int plane_lower_bound(const Plane *plane, int key) {
+	int low, high, middle;
+	
+	low = 0;
+	high = plane->num_cells;
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (plane->keys[middle] < key) low = middle + 1;
+		else high = middle;
+	}
+	return low;
+}
+
+/* Collect the occupied cells of the stencil around (gx, gy, gz), X-major,
+ * returns how many entries were written. The occupied cells of one stencil
+ * row are adjacent in their plane, so every row is a single view of their
+ * particles. */
+static int gather_neighbors(int gx, int gy, int gz, GridCell *neighbors) {
+	int n, ngx, center, first, last, base, low, high, count;
+	const StencilRow *row;
+	const Plane *plane;
+	
+#if SIM_DIMS == 3
+	center = gz;
+#else
+	center = gy;
+	(void)gz;
+#endif
+	
+	count = 0;
+	for (n = 0; n < stencil_rows; n++) {
+		row = &stencil[n];
+		ngx = gx + row->dx;
+		if (ngx < 0 || ngx >= GRID_SIZE) continue;
+		plane = &grid_planes[ngx];
+		if (plane->num_cells == 0) continue;
+#if SIM_DIMS == 3
+		if (gy + row->dy < 0 || gy + row->dy >= GRID_SIZE) continue;
+		base = (gy + row->dy) * GRID_SIZE_Z;
+#else
+		base = 0;
+#endif
+		first = center - row->reach;
+		if (first < 0) first = 0;
+		last = center + row->reach;
+		if (last > GRID_SIZE - 1) last = GRID_SIZE - 1;
+		
+		low = plane_lower_bound(plane, base + first);
+		high = low;
+		while (high < plane->num_cells && plane->keys[high] <= base + last) high++;
+		if (high == low) continue;
+		
+		neighbors[count].particles = plane->cells[low].particles;
+		neighbors[count].count = (int)(plane->cells[high - 1].particles + plane->cells[high - 1].count -
+									   plane->cells[low].particles);
+		neighbors[count].capacity = neighbors[count].count;
+		count++;
+	}
+	return count;
+}
+
+int grid_cell_count(void) {
+	sync_grid();
+	return plane_first[GRID_SIZE];
+}
+
+int grid_first_cell(int gx) {
+	sync_grid();
+	if (gx < 0) gx = 0;
+	if (gx > GRID_SIZE) gx = GRID_SIZE;
+	return plane_first[gx];
+}
+
+GridCell *grid_cell(int index, int *gx, int *gy, int *gz) {
+	int low, high, middle, cell;
+	
+	sync_grid();
+	
+	/* Last plane whose first cell is at or before index */
+	low = 0;
+	high = GRID_SIZE - 1;
+	while (low < high) {
+		middle = (low + high + 1) / 2;
+		if (plane_first[middle] <= index) low = middle;
+		else high = middle - 1;
+	}
+	cell = index - plane_first[low];
+	
+	if (gx) *gx = low;
+	if (gy) *gy = grid_planes[low].keys[cell] / GRID_SIZE_Z;
+	if (gz) *gz = grid_planes[low].keys[cell] % GRID_SIZE_Z;
+	return &grid_planes[low].cells[cell];
+}
+
+GridCell *grid_find(int gx, int gy, int gz, int *index) {
+	int cell;
+	
+	if (gx < 0 || gx >= GRID_SIZE || gy < 0 || gy >= GRID_SIZE ||
+		gz < 0 || gz >= GRID_SIZE_Z) return NULL;
+	
+	sync_grid();
+	cell = plane_lookup(&grid_planes[gx], gy * GRID_SIZE_Z + gz);
+	if (cell < 0) return NULL;
+	if (index) *index = plane_first[gx] + cell;
+	return &grid_planes[gx].cells[cell];
+}
+
+#else
+
 /* Simple function to add particle to grid */
 static void add_particle_to_grid(GridCell *cell, Cell particle) {
 	int new_capacity;
@@ -87,242 +686,838 @@ static void add_particle_to_grid(GridCell *cell, Cell particle) {
 	cell->count++;
 }
 
-void init_grid_with_particles(void) {
-	int gx, gy, gz;
-	int particles_created;
-	Cell new_particle;
+/* Cell of a worker's temporary grid */
+#define TEMP_CELL(t, gx, gy, gz) (&temp_grids[t][((gx) * GRID_SIZE + (gy)) * GRID_SIZE_Z + (gz)])
+
+/* Move a cell's particle buffer into memory first touched by the calling thread */
+static void rehome_cell(GridCell *cell) {
+	Cell *local;
 	
-	particles_created = 0;
+	if (cell->capacity == 0) return;
+	
+	local = (Cell*)malloc(cell->capacity * sizeof(Cell));
+	if (!local) return;  /* Keep the old buffer, it is still valid */
+	
+	/* Touch the whole buffer so every page is placed on this node */
+	memset(local, 0, cell->capacity * sizeof(Cell));
+	memcpy(local, cell->particles, cell->count * sizeof(Cell));
+	free(cell->particles);
+	cell->particles = local;
+}
+
+/* Insert a particle into the grid */
+static void place_particle(const Cell *particle, int gx, int gy, int gz) {
+	GridCell *cell = &grid[gx][gy][gz];
+	int capacity = cell->capacity;
+	
+	add_particle_to_grid(cell, *particle);
+	if (cell->capacity != capacity) {
+		rehome_planes[gx] = 1;  /* Grown by the main thread */
+	}
+}
+
+/* Empty every grid. Existing particle buffers are kept (they start out NULL)
+ * so a reset does not leak them and they stay on the node that touched them. */
+static void clear_grids(void) {
+	int gx, gy, gz, t;
 	
-	/* Clear all grids and ensure particles pointers are NULL */
 	for (gx = 0; gx < GRID_SIZE; gx++) {
 		for (gy = 0; gy < GRID_SIZE; gy++) {
-			for (gz = 0; gz < GRID_SIZE; gz++) {
+			for (gz = 0; gz < GRID_SIZE_Z; gz++) {
 				grid[gx][gy][gz].count = 0;
-				grid[gx][gy][gz].capacity = 0;
-				grid[gx][gy][gz].particles = NULL;
-				
 				work_grid[gx][gy][gz].count = 0;
-				work_grid[gx][gy][gz].capacity = 0;
-				work_grid[gx][gy][gz].particles = NULL;
 				
-				/* Initialize temporary grids as well */
-				temp_grid1[gx][gy][gz].count = 0;
-				temp_grid1[gx][gy][gz].capacity = 0;
-				temp_grid1[gx][gy][gz].particles = NULL;
+				/* Clear temporary grids as well */
+				for (t = 0; t < MAX_THREADS; t++) {
+					if (temp_grids[t]) TEMP_CELL(t, gx, gy, gz)->count = 0;
+				}
+			}
+		}
+	}
+}
+
+static void free_cell(GridCell *cell) {
+	if (cell->particles) {
+		free(cell->particles);
+		cell->particles = NULL;
+		cell->count = 0;
+		cell->capacity = 0;
+	}
+}
+
+static void free_grids(void) {
+	int gx, gy, gz, t;
+	
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		for (gy = 0; gy < GRID_SIZE; gy++) {
+			for (gz = 0; gz < GRID_SIZE_Z; gz++) {
+				free_cell(&grid[gx][gy][gz]);
+				free_cell(&work_grid[gx][gy][gz]);
+				for (t = 0; t < MAX_THREADS; t++) {
+					if (temp_grids[t]) free_cell(TEMP_CELL(t, gx, gy, gz));
+				}
+			}
+		}
+	}
+	for (t = 0; t < MAX_THREADS; t++) {
+		free(temp_grids[t]);
+		temp_grids[t] = NULL;
+	}
+}
+
+/* Clear one worker's temporary grid. It is allocated on first use, so only
+ * workers that run get one and it is first touched by its own thread. */
+static void clear_bins(int thread_id) {
+	int gx, gy, gz;
+	
+	if (!temp_grids[thread_id]) {
+		temp_grids[thread_id] = (GridCell*)calloc(GRID_SIZE * GRID_SIZE * GRID_SIZE_Z, sizeof(GridCell));
+		if (!temp_grids[thread_id]) {
+			printf("CRITICAL ERROR: Could not allocate memory!\n");
+		}
+		return;
+	}
+	
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		for (gy = 0; gy < GRID_SIZE; gy++) {
+			for (gz = 0; gz < GRID_SIZE_Z; gz++) {
+				TEMP_CELL(thread_id, gx, gy, gz)->count = 0;
+			}
+		}
+	}
+}
+
+/* Add a moved particle to the worker's temporary grid (THREAD-SAFE) */
+static void bin_particle(int thread_id, const Cell *particle, int gx, int gy, int gz) {
+	if (!temp_grids[thread_id]) return;  /* Allocation failed, the particle is lost */
+	add_particle_to_grid(TEMP_CELL(thread_id, gx, gy, gz), *particle);
+}
+
+/* STEP 4: Combine one cell from all temporary grids into work_grid */
+static void merge_cell(int gx, int gy, int gz) {
+	GridCell *work_cell, *temp_cell;
+	int t, i;
+	
+	work_cell = &work_grid[gx][gy][gz];
+	work_cell->count = 0;
+	for (t = 0; t < num_threads; t++) {
+		if (!temp_grids[t]) continue;
+		temp_cell = TEMP_CELL(t, gx, gy, gz);
+		for (i = 0; i < temp_cell->count; i++) {
+			add_particle_to_grid(work_cell, temp_cell->particles[i]);
+		}
+	}
+}
+
+/* STEP 4 for a whole plane */
+static void merge_plane(int gx, int thread_id) {
+	int gy, gz;
+	
+	(void)thread_id;
+	for (gy = 0; gy < GRID_SIZE; gy++) {
+		for (gz = 0; gz < GRID_SIZE_Z; gz++) {
+			if (rehome_planes[gx]) {
+				rehome_cell(&grid[gx][gy][gz]);
+				rehome_cell(&work_grid[gx][gy][gz]);
+			}
+			merge_cell(gx, gy, gz);
+		}
+	}
+}
+
+/* STEP 5: Swap one cell of grid and work_grid */
+static void swap_cell(int gx, int gy, int gz) {
+	GridCell temp;
+	
+	temp = grid[gx][gy][gz];
+	grid[gx][gy][gz] = work_grid[gx][gy][gz];
+	work_grid[gx][gy][gz] = temp;
+}
+
+/* STEP 5 for a whole plane */
+static void swap_plane(int gx) {
+	int gy, gz;
+	
+	for (gy = 0; gy < GRID_SIZE; gy++) {
+		for (gz = 0; gz < GRID_SIZE_Z; gz++) {
+			swap_cell(gx, gy, gz);
+		}
+	}
+}
+
+/* Collect the non-empty cells of the stencil around (gx, gy, gz), X-major,
+ * returns how many */
+static int gather_neighbors(int gx, int gy, int gz, GridCell *neighbors) {
+	int n, ngx, ngy, center, first, last, i, count;
+	const StencilRow *row;
+	const GridCell *cell;
+	
+#if SIM_DIMS == 3
+	center = gz;
+#else
+	center = gy;
+	(void)gz;
+#endif
+	
+	count = 0;
+	for (n = 0; n < stencil_rows; n++) {
+		row = &stencil[n];
+		ngx = gx + row->dx;
+		ngy = gy + row->dy;
+		if (ngx < 0 || ngx >= GRID_SIZE || ngy < 0 || ngy >= GRID_SIZE) continue;
+		first = center - row->reach;
+		if (first < 0) first = 0;
+		last = center + row->reach;
+		if (last > GRID_SIZE - 1) last = GRID_SIZE - 1;
+		
+		for (i = first; i <= last; i++) {
+#if SIM_DIMS == 3
+			cell = &grid[ngx][ngy][i];
+#else
+			cell = &grid[ngx][i][0];
+#endif
+			if (cell->count > 0) neighbors[count++] = *cell;
+		}
+	}
+	return count;
+}
+
+int grid_cell_count(void) {
+	return GRID_SIZE * GRID_SIZE * GRID_SIZE_Z;
+}
+
+int grid_first_cell(int gx) {
+	if (gx < 0) gx = 0;
+	if (gx > GRID_SIZE) gx = GRID_SIZE;
+	return gx * GRID_SIZE * GRID_SIZE_Z;
+}
+
+GridCell *grid_cell(int index, int *gx, int *gy, int *gz) {
+	if (gx) *gx = index / (GRID_SIZE * GRID_SIZE_Z);
+	if (gy) *gy = index / GRID_SIZE_Z % GRID_SIZE;
+	if (gz) *gz = index % GRID_SIZE_Z;
+	return &grid[0][0][0] + index;
+}
+
+GridCell *grid_find(int gx, int gy, int gz, int *index) {
+	if (gx < 0 || gx >= GRID_SIZE || gy < 0 || gy >= GRID_SIZE ||
+		gz < 0 || gz >= GRID_SIZE_Z) return NULL;
+	
+	if (index) *index = (gx * GRID_SIZE + gy) * GRID_SIZE_Z + gz;
+	return &grid[gx][gy][gz];
+}
+
+#endif
+
+/* Particle ID registry. Removed particles are only marked here; the next
+ * step drops them while rebinning, so removal never touches the grid and
+ * costs O(1). Until then they are still drawn and still push their neighbors. */
+#define ID_FREE   0
+#define ID_ALIVE  1
+#define ID_DOOMED 2  /* Removed, dropped from the grid by the next step */
+
+typedef struct {
+	int count;
+	int capacity;
+	int *ids;
+} IdList;
+
+static unsigned char *id_state = NULL;  /* ID_FREE / ID_ALIVE / ID_DOOMED per ID */
+static unsigned char *id_type = NULL;   /* Type of every handed out ID */
+static int *id_slot = NULL;             /* Position of an alive ID in its type list */
+static int id_capacity = 0;
+static int next_id = 0;                 /* IDs below this have been handed out */
+static IdList free_ids;                 /* Released IDs, reused first */
+static IdList doomed_ids;               /* Removed since the last step */
+static IdList type_ids[NUM_TYPES];      /* Alive IDs of every type */
+
+static int push_id(IdList *list, int id) {
+	int new_capacity;
+	int *new_ids;
+	
+	if (list->count >= list->capacity) {
+		new_capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+		new_ids = (int*)realloc(list->ids, new_capacity * sizeof(int));
+		if (!new_ids) {
+			printf("CRITICAL ERROR: Could not allocate memory!\n");
+			return -1;
+		}
+		list->ids = new_ids;
+		list->capacity = new_capacity;
+	}
+	
+	list->ids[list->count++] = id;
+	return 0;
+}
+
+/* Hand out an ID for a new particle of the given type, -1 on failure */
+static int allocate_id(int type) {
+	int id, new_capacity;
+	unsigned char *new_state, *new_type;
+	int *new_slot;
+	
+	if (free_ids.count > 0) {
+		id = free_ids.ids[--free_ids.count];
+	} else {
+		if (next_id >= id_capacity) {
+			new_capacity = id_capacity == 0 ? 1024 : id_capacity * 2;
+			new_state = (unsigned char*)realloc(id_state, new_capacity);
+			if (new_state) id_state = new_state;
+			new_type = (unsigned char*)realloc(id_type, new_capacity);
+			if (new_type) id_type = new_type;
+			new_slot = (int*)realloc(id_slot, new_capacity * sizeof(int));
+			if (new_slot) id_slot = new_slot;
+			if (!new_state || !new_type || !new_slot) {
+				printf("CRITICAL ERROR: Could not allocate memory!\n");
+				return -1;
+			}
+			id_capacity = new_capacity;
+		}
+		id = next_id++;
+	}
+	
+	if (push_id(&type_ids[type], id) != 0) {
+		push_id(&free_ids, id);
+		return -1;
+	}
+	
+	id_state[id] = ID_ALIVE;
+	id_type[id] = (unsigned char)type;
+	id_slot[id] = type_ids[type].count - 1;
+	return id;
+}
+
+/* Forget every ID - only valid while the grid is being cleared */
+static void reset_ids(void) {
+	int t;
+	
+	next_id = 0;
+	free_ids.count = 0;
+	doomed_ids.count = 0;
+	for (t = 0; t < NUM_TYPES; t++) {
+		type_ids[t].count = 0;
+	}
+}
+
+/* IDs removed before the last step are gone from the grid now */
+static void release_doomed_ids(void) {
+	int i, id;
+	
+	for (i = 0; i < doomed_ids.count; i++) {
+		id = doomed_ids.ids[i];
+		id_state[id] = ID_FREE;
+		push_id(&free_ids, id);
+	}
+	doomed_ids.count = 0;
+}
+
+/* Removed since the last step, so still in the grid but no longer counted */
+int particle_removed(int id) {
+	return id_state[id] == ID_DOOMED;
+}
+
+/* Uniform random number below n, also when n is larger than RAND_MAX */
+static int random_below(int n) {
+	unsigned long r;
+	
+	r = (unsigned long)rand();
+	r = r * ((unsigned long)RAND_MAX + 1) + (unsigned long)rand();
+	return (int)(r % (unsigned long)n);
+}
+
+/* Insert a particle between steps. Returns its ID or -1 on error. */
+int spawn_particle(float x, float y, float z, int type) {
+	Cell new_particle;
+	int id;
+	
+	if (type < 0 || type >= NUM_TYPES) return -1;
+	
+	id = allocate_id(type);
+	if (id < 0) return -1;
+	
+	/* Keep spawned particles inside the world */
+	if (x < -1.0f) x = -1.0f; else if (x > 1.0f) x = 1.0f;
+	if (y < -1.0f) y = -1.0f; else if (y > 1.0f) y = 1.0f;
+	if (z < -1.0f) z = -1.0f; else if (z > 1.0f) z = 1.0f;
+	
+	new_particle.x = x;
+	new_particle.y = y;
+	new_particle.vx = 0.0f;
+	new_particle.vy = 0.0f;
+#if SIM_DIMS == 3
+	new_particle.z = z;
+	new_particle.vz = 0.0f;
+#endif
+	new_particle.type = type;
+	new_particle.id = id;
+	
+	place_particle(&new_particle, coord_to_grid(x), coord_to_grid(y), coord_to_grid_z(z));
+	total_particles++;
+	return id;
+}
+
+/* Remove a particle by ID between steps. Returns 1 if it was alive. */
+int remove_particle(int id) {
+	IdList *list;
+	int slot, last;
+	
+	if (id < 0 || id >= next_id || id_state[id] != ID_ALIVE) return 0;
+	
+	/* Swap-remove from its type list */
+	list = &type_ids[id_type[id]];
+	slot = id_slot[id];
+	last = list->ids[--list->count];
+	list->ids[slot] = last;
+	id_slot[last] = slot;
+	
+	id_state[id] = ID_DOOMED;
+	push_id(&doomed_ids, id);
+	total_particles--;
+	return 1;
+}
+
+/* Remove up to count randomly chosen particles of one type. Returns the number removed. */
+int remove_particles_of_type(int type, int count) {
+	int removed;
+	
+	if (type < 0 || type >= NUM_TYPES) return 0;
+	
+	removed = 0;
+	while (removed < count && type_ids[type].count > 0) {
+		removed += remove_particle(type_ids[type].ids[rand() % type_ids[type].count]);
+	}
+	return removed;
+}
+
+/* Remove every particle inside a box. Only the cells that overlap the box
+ * are visited. Returns the number removed. */
+int remove_particles_in_region(float min_x, float min_y, float min_z,
+							   float max_x, float max_y, float max_z) {
+	int gx, gy, gz, i, removed;
+	GridCell *cell;
+	Cell *particle;
+	
+	removed = 0;
+	for (gx = coord_to_grid(min_x); gx <= coord_to_grid(max_x); gx++) {
+		for (gy = coord_to_grid(min_y); gy <= coord_to_grid(max_y); gy++) {
+			for (gz = coord_to_grid_z(min_z); gz <= coord_to_grid_z(max_z); gz++) {
+				cell = grid_find(gx, gy, gz, NULL);
+				if (!cell) continue;
 				
-				temp_grid2[gx][gy][gz].count = 0;
-				temp_grid2[gx][gy][gz].capacity = 0;
-				temp_grid2[gx][gy][gz].particles = NULL;
+				for (i = 0; i < cell->count; i++) {
+					particle = &cell->particles[i];
+					if (particle->x < min_x || particle->x > max_x ||
+						particle->y < min_y || particle->y > max_y) continue;
+#if SIM_DIMS == 3
+					if (particle->z < min_z || particle->z > max_z) continue;
+#else
+					(void)min_z;
+					(void)max_z;
+#endif
+					removed += remove_particle(particle->id);
+				}
 			}
 		}
 	}
+	return removed;
+}
+
+/* Spawn one particle of a random type at a random position. The random
+ * numbers are drawn in a fixed order, so a seed gives the same particles
+ * with every compiler. Returns its ID or -1 on error. */
+static int spawn_random_particle(void) {
+	float x, y, z;
+	int type;
+	
+	x = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
+	y = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
+	z = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
+	type = rand() % NUM_TYPES;
+	return spawn_particle(x, y, z, type);
+}
+
+/* Grow or shrink the population to count particles with random spawns and removals */
+int set_particle_count(int count) {
+	int t, alive, index;
+	
+	while (total_particles < count) {
+		if (spawn_random_particle() < 0) break;
+	}
+	while (total_particles > count) {
+		/* Every alive particle is equally likely, whatever its type */
+		alive = 0;
+		for (t = 0; t < NUM_TYPES; t++) {
+			alive += type_ids[t].count;
+		}
+		if (alive == 0) break;
+		
+		index = random_below(alive);
+		for (t = 0; index >= type_ids[t].count; t++) {
+			index -= type_ids[t].count;
+		}
+		remove_particle(type_ids[t].ids[index]);
+	}
+	return total_particles;
+}
+
+void init_grid_with_particles(void) {
+	int particles_created, target;
+	
+	particles_created = 0;
+	target = total_particles;
+	total_particles = 0;
+	reset_ids();
+	clear_grids();
 	
 	/* Create particles randomly */
-	while (particles_created < total_particles) {
-		new_particle.x = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-		new_particle.y = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-		new_particle.z = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-		new_particle.vx = 0.0f;
-		new_particle.vy = 0.0f;
-		new_particle.vz = 0.0f;
-		new_particle.type = rand() % NUM_TYPES;
-		
-		/* Find correct grid cell */
-		gx = coord_to_grid(new_particle.x);
-		gy = coord_to_grid(new_particle.y);
-		gz = coord_to_grid(new_particle.z);
-		
-		/* Add particle */
-		add_particle_to_grid(&grid[gx][gy][gz], new_particle);
+	while (particles_created < target) {
+		if (spawn_random_particle() < 0) break;
 		particles_created++;
 	}
 	
 	printf("Created %d particles\n", particles_created);
 }
 
-/* Structure for sending data to worker threads */
-typedef struct {
-	int thread_id;  /* 0 for even cells, 1 for odd cells */
-} ThreadData;
+/* Count the live particles in the grid - removed ones wait there for the next step */
+int count_particles(void) {
+	int c, num_cells, i, count;
+	GridCell *cell;
+	
+	count = 0;
+	num_cells = grid_cell_count();
+	for (c = 0; c < num_cells; c++) {
+		cell = grid_cell(c, NULL, NULL, NULL);
+		for (i = 0; i < cell->count; i++) {
+			if (!particle_removed(cell->particles[i].id)) count++;
+		}
+	}
+	
+	return count;
+}
 
-/* Worker function to process particles */
-static void* particle_worker(void* arg) {
-	ThreadData* data = (ThreadData*)arg;
-	int thread_id = data->thread_id;
-	int gx, gy, gz, ngx, ngy, ngz;
-	int i, j, new_gx, new_gy, new_gz;
+/* Write every particle as "x y z vx vy vz type id" (z = 0 in 2D) - call between
+ * steps only. Returns the number of particles written or -1 on error. */
+int write_snapshot(const char *filename) {
+	FILE *file;
+	int c, num_cells, i, written;
+	GridCell *cell;
+	Cell *particle;
+	
+	file = fopen(filename, "w");
+	if (!file) {
+		printf("ERROR: Could not open snapshot file %s\n", filename);
+		return -1;
+	}
+	
+	fprintf(file, "# step %ld particles %d\n", step_count, total_particles);
+	
+	written = 0;
+	num_cells = grid_cell_count();
+	for (c = 0; c < num_cells; c++) {
+		cell = grid_cell(c, NULL, NULL, NULL);
+		for (i = 0; i < cell->count; i++) {
+			particle = &cell->particles[i];
+			if (particle_removed(particle->id)) continue;
+			fprintf(file, "%f %f %f %f %f %f %d %d\n",
+					particle->x, particle->y, CELL_Z(particle),
+					particle->vx, particle->vy, CELL_VZ(particle),
+					particle->type, particle->id);
+			written++;
+		}
+	}
+	
+	fclose(file);
+	return written;
+}
+
+/* Mark every plane for (or clear it of) a move to its owner's memory. Planes
+ * grown by the main thread - at startup, by spawns or a reset - are marked
+ * one by one so the owning workers move them on the next step. */
+static void set_rehome(int value) {
+	int gx;
+	
+	for (gx = 0; gx < GRID_SIZE; gx++) {
+		rehome_planes[gx] = (unsigned char)value;
+	}
+}
+
+/* Wall clock in microseconds for per-thread timing */
+static double time_usec(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1000000.0 + (double)tv.tv_usec;
+}
+
+/* Number of online CPUs, MAX_CPUS if the system cannot tell */
+static int online_cpus(void) {
+	long cpus = -1;
+	
+#if defined(_SC_NPROCESSORS_ONLN)
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#elif defined(_SC_NPROC_ONLN)
+	cpus = sysconf(_SC_NPROC_ONLN);  /* IRIX */
+#endif
+	return cpus > 0 ? (int)cpus : MAX_CPUS;
+}
+
+/* Bind the calling thread to a single CPU */
+static void pin_thread_to_cpu(int cpu) {
+#if defined(__sgi)
+	if (pthread_setrunon_np(cpu) != 0) {
+		printf("WARNING: Could not pin thread to CPU %d\n", cpu);
+	}
+#elif defined(__linux__)
+	cpu_set_t cpus;
+	
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		printf("WARNING: Could not pin thread to CPU %d\n", cpu);
+	}
+#else
+	(void)cpu;
+	printf("WARNING: Thread pinning not supported on this platform\n");
+#endif
+}
+
+/* Sum the forces on one particle: central attraction plus every particle of
+ * the surrounding cells from gather_neighbors() within the interaction distance.
+ * The Z terms only exist in 3D builds. */
+static void accumulate_forces(const Cell *current_particle, const GridCell *neighbors, int num_neighbors,
+							  const SimParams *params, float *out_fx, float *out_fy, float *out_fz) {
+	int n, j;
 	float dx, dy, dz, dist_sq, dist, force;
 	float fx, fy, fz;
-	float vmix, center_force, base_radius, collision_force;
+	float center_force, base_radius, collision_force, max_dist_sq;
 	float radius_i, radius_j, min_dist, collision_start_sq, collision_intensity;
+	const GridCell *neighbor;
+	const Cell *other_particle;
+	
+	center_force = params->center_force;
+	base_radius = params->base_radius;
+	collision_force = params->collision_force;
+	max_dist_sq = params->max_dist_sq;
+	fx = fy = fz = 0.0f;
+	dz = 0.0f;
+	
+	/* Calculate this particle's radius */
+	radius_i = base_radius + (CELL_Z(current_particle) + 1.0f) * 0.01f;
+	
+	/* Central attraction toward origin */
+	dx = -current_particle->x;
+	dy = -current_particle->y;
+#if SIM_DIMS == 3
+	dz = -current_particle->z;
+	dist_sq = dx*dx + dy*dy + dz*dz;
+#else
+	dist_sq = dx*dx + dy*dy;
+#endif
+	if (dist_sq > 0.0001f) {
+		dist = sqrt(dist_sq);
+		force = center_force / dist;
+		fx += force * dx;
+		fy += force * dy;
+#if SIM_DIMS == 3
+		fz += force * dz;
+#endif
+	}
+	
+	/* Interact with the particles of every neighboring cell */
+	for (n = 0; n < num_neighbors; n++) {
+		neighbor = &neighbors[n];
+		for (j = 0; j < neighbor->count; j++) {
+			other_particle = &neighbor->particles[j];
+			
+			/* Skip self */
+			if (current_particle == other_particle) continue;
+			
+			/* Fast distance check without wraparound first */
+			dx = current_particle->x - other_particle->x;
+			dy = current_particle->y - other_particle->y;
+#if SIM_DIMS == 3
+			dz = current_particle->z - other_particle->z;
+			dist_sq = dx*dx + dy*dy + dz*dz;
+#else
+			dist_sq = dx*dx + dy*dy;
+#endif
+			
+			/* Early distance cutoff */
+			if (dist_sq > max_dist_sq) {
+				/* Check if wraparound might help */
+				if (dx > 1.0f || dx < -1.0f || 
+					dy > 1.0f || dy < -1.0f || 
+					dz > 1.0f || dz < -1.0f) {
+					/* Only then calculate periodic distance */
+					calc_periodic_distance(current_particle->x, current_particle->y, CELL_Z(current_particle), 
+										   other_particle->x, other_particle->y, CELL_Z(other_particle), 
+										   &dx, &dy, &dz);
+#if SIM_DIMS == 3
+					dist_sq = dx*dx + dy*dy + dz*dz;
+#else
+					dist_sq = dx*dx + dy*dy;
+#endif
+					if (dist_sq > max_dist_sq) continue;
+				} else {
+					continue;
+				}
+			}
+			
+			if (dist_sq < 0.0001f) continue;
+			
+			/* Calculate other particle's radius */
+			radius_j = base_radius + (CELL_Z(other_particle) + 1.0f) * 0.01f;
+			min_dist = radius_i + radius_j;
+			collision_start_sq = min_dist * min_dist * 9.0f;
+			
+			/* Collision or attraction handling */
+			if (dist_sq < collision_start_sq) {
+				dist = sqrt(dist_sq);
+				collision_intensity = (sqrt(collision_start_sq) - dist) / sqrt(collision_start_sq);
+				force = collision_force * collision_intensity / dist_sq;
+			} else {
+				dist = sqrt(dist_sq);
+				force = attraction[current_particle->type][other_particle->type] / dist;
+			}
+			fx += force * dx;
+			fy += force * dy;
+#if SIM_DIMS == 3
+			fz += force * dz;
+#endif
+		}
+	}
+	
+	*out_fx = fx;
+	*out_fy = fy;
+	*out_fz = fz;
+}
+
+/* Integrate every particle of one cell and bin it by its new position */
+static void process_cell(ThreadData *data, const SimParams *params, GridCell *cell, int gx, int gy, int gz) {
+	int num_neighbors, i, new_gx, new_gy, new_gz;
+	float fx, fy, fz;
 	Cell updated_particle;
-	Cell *current_particle, *other_particle;
-	float max_dist_sq = 0.06f;  /* Reduced from 0.09f for better performance */
+	Cell *current_particle;
 	
-	/* Physics parameters - reduced friction for more lively movements */
-	vmix = 0.95f;  
-	center_force = 0.05f;
-	base_radius = 0.02f;
-	collision_force = 0.005f;
+	/* The neighbor cells are the same for every particle of the cell. Without
+	 * a big enough buffer only the central attraction is left. */
+	num_neighbors = 0;
+	if (data->neighbor_capacity >= stencil_slots) {
+		num_neighbors = gather_neighbors(gx, gy, gz, data->neighbors);
+	}
 	
-	while (threads_running) {
+	/* Process ALL particles in this grid cell */
+	for (i = 0; i < cell->count; i++) {
+		current_particle = &cell->particles[i];
+		
+		/* Removed particles are not carried into the next grid */
+		if (id_state[current_particle->id] == ID_DOOMED) continue;
+		
+		/* Sum forces from the central attraction and the neighbor cells */
+		accumulate_forces(current_particle, data->neighbors, num_neighbors, params, &fx, &fy, &fz);
+		
+		/* Create updated particle */
+		updated_particle = *current_particle;
+		
+		/* Update velocity and position */
+		updated_particle.vx = updated_particle.vx * params->vmix + fx * params->force_scale;
+		updated_particle.vy = updated_particle.vy * params->vmix + fy * params->force_scale;
+		
+		updated_particle.x += updated_particle.vx;
+		updated_particle.y += updated_particle.vy;
+		
+		/* Wrap-around handling */
+		if (updated_particle.x > 1.0f) updated_particle.x -= 2.0f;
+		else if (updated_particle.x < -1.0f) updated_particle.x += 2.0f;
+		
+		if (updated_particle.y > 1.0f) updated_particle.y -= 2.0f;
+		else if (updated_particle.y < -1.0f) updated_particle.y += 2.0f;
+		
+#if SIM_DIMS == 3
+		updated_particle.vz = updated_particle.vz * params->vmix + fz * params->force_scale;
+		updated_particle.z += updated_particle.vz;
+		if (updated_particle.z > 1.0f) updated_particle.z -= 2.0f;
+		else if (updated_particle.z < -1.0f) updated_particle.z += 2.0f;
+#endif
+		
+		/* Find new grid position for the updated particle */
+		new_gx = coord_to_grid(updated_particle.x);
+		new_gy = coord_to_grid(updated_particle.y);
+		new_gz = coord_to_grid_z(CELL_Z(&updated_particle));
+		
+		/* Particles leaving the node's region are merged by a remote node */
+		if (new_gx < data->node_start || new_gx >= data->node_end) {
+			data->exported++;
+		}
+		data->particles++;
+		
+		bin_particle(data->thread_id, &updated_particle, new_gx, new_gy, new_gz);
+	}
+}
+
+/* Worker function to process particles */
+static void* particle_worker(void* arg) {
+	ThreadData* data = (ThreadData*)arg;
+	int thread_id = data->thread_id;
+	int c, last, gx, gy, gz;
+	double phase_start;
+	SimParams params;
+	GridCell *cell;
+	
+	if (thread_pinning) {
+		pin_thread_to_cpu(data->cpu);
+	}
+	
+	/* Exit is only checked after the barrier - testing threads_running before it
+	 * races with cleanup_threads() and can leave the main thread waiting alone */
+	for (;;) {
 		/* Wait for all threads to start */
 		pthread_barrier_wait(&barrier);
 		
 		if (!threads_running) break;
 		
-		/* Clear this thread's temporary grid */
-		for (gx = 0; gx < GRID_SIZE; gx++) {
-			for (gy = 0; gy < GRID_SIZE; gy++) {
-				for (gz = 0; gz < GRID_SIZE; gz++) {
-					if (thread_id == 0) {
-						temp_grid1[gx][gy][gz].count = 0;
-					} else {
-						temp_grid2[gx][gy][gz].count = 0;
-					}
-				}
-			}
+		phase_start = time_usec();
+		
+		/* Physics parameters only change between steps */
+		params = sim_params;
+		
+		/* Room for the neighbors of one cell, on this thread's node */
+		reserve((void**)&data->neighbors, &data->neighbor_capacity, stencil_slots, sizeof(GridCell));
+		
+		/* Cluster analysis reads the same grid as the force pass */
+		if (cluster_pass) {
+			clusters_link_slab(thread_id, data->slab_start, data->slab_end);
 		}
 		
-		/* Process grid cells based on thread ID (even/odd cells) */
-		for (gx = 0; gx < GRID_SIZE; gx++) {
-			for (gy = 0; gy < GRID_SIZE; gy++) {
-				for (gz = 0; gz < GRID_SIZE; gz++) {
-					/* Divide work: even/odd grid cells */
-					int cell_sum = gx + gy + gz;
-					if ((cell_sum % 2) != thread_id) continue;
-					
-					/* Skip empty cells */
-					if (grid[gx][gy][gz].count == 0) continue;
-					
-					/* Process ALL particles in this grid cell */
-					for (i = 0; i < grid[gx][gy][gz].count; i++) {
-						current_particle = &grid[gx][gy][gz].particles[i];
-						fx = fy = fz = 0.0f;
-						
-						/* Calculate this particle's radius */
-						radius_i = base_radius + (current_particle->z + 1.0f) * 0.01f;
-						
-						/* Central attraction toward origin */
-						dx = -current_particle->x;
-						dy = -current_particle->y;
-						dz = -current_particle->z;
-						dist_sq = dx*dx + dy*dy + dz*dz;
-						if (dist_sq > 0.0001f) {
-							dist = sqrt(dist_sq);
-							force = center_force / dist;
-							fx += force * dx;
-							fy += force * dy;
-							fz += force * dz;
-						}
-						
-						/* Check neighboring cells for interactions - optimized loop order */
-						for (ngx = gx - 1; ngx <= gx + 1; ngx++) {
-							if (ngx < 0 || ngx >= GRID_SIZE) continue;
-							for (ngy = gy - 1; ngy <= gy + 1; ngy++) {
-								if (ngy < 0 || ngy >= GRID_SIZE) continue;
-								for (ngz = gz - 1; ngz <= gz + 1; ngz++) {
-									if (ngz < 0 || ngz >= GRID_SIZE) continue;
-									
-									/* Skip empty cells early */
-									if (grid[ngx][ngy][ngz].count == 0) continue;
-									
-									/* Interact with particles in this neighboring cell */
-									for (j = 0; j < grid[ngx][ngy][ngz].count; j++) {
-										other_particle = &grid[ngx][ngy][ngz].particles[j];
-										
-										/* Skip self */
-										if (current_particle == other_particle) continue;
-										
-										/* Fast distance check without wraparound first */
-										dx = current_particle->x - other_particle->x;
-										dy = current_particle->y - other_particle->y;
-										dz = current_particle->z - other_particle->z;
-										dist_sq = dx*dx + dy*dy + dz*dz;
-										
-										/* Early distance cutoff */
-										if (dist_sq > max_dist_sq) {
-											/* Check if wraparound might help */
-											if (dx > 1.0f || dx < -1.0f || 
-												dy > 1.0f || dy < -1.0f || 
-												dz > 1.0f || dz < -1.0f) {
-												/* Only then calculate periodic distance */
-												calc_periodic_distance(current_particle->x, current_particle->y, current_particle->z, 
-																	   other_particle->x, other_particle->y, other_particle->z, 
-																	   &dx, &dy, &dz);
-												dist_sq = dx*dx + dy*dy + dz*dz;
-												if (dist_sq > max_dist_sq) continue;
-											} else {
-												continue;
-											}
-										}
-										
-										if (dist_sq < 0.0001f) continue;
-										
-										/* Calculate other particle's radius */
-										radius_j = base_radius + (other_particle->z + 1.0f) * 0.01f;
-										min_dist = radius_i + radius_j;
-										collision_start_sq = min_dist * min_dist * 9.0f;
-										
-										/* Collision or attraction handling */
-										if (dist_sq < collision_start_sq) {
-											dist = sqrt(dist_sq);
-											collision_intensity = (sqrt(collision_start_sq) - dist) / sqrt(collision_start_sq);
-											force = collision_force * collision_intensity / dist_sq;
-											fx += force * dx;
-											fy += force * dy;
-											fz += force * dz;
-										} else {
-											dist = sqrt(dist_sq);
-											force = attraction[current_particle->type][other_particle->type] / dist;
-											fx += force * dx;
-											fy += force * dy;
-											fz += force * dz;
-										}
-									}
-								}
-							}
-						}
-						
-						/* Create updated particle */
-						updated_particle = *current_particle;
-						
-						/* Update velocity and position */
-						updated_particle.vx = updated_particle.vx * vmix + fx * 0.005f;
-						updated_particle.vy = updated_particle.vy * vmix + fy * 0.005f;
-						updated_particle.vz = updated_particle.vz * vmix + fz * 0.005f;
-						
-						updated_particle.x += updated_particle.vx;
-						updated_particle.y += updated_particle.vy;
-						updated_particle.z += updated_particle.vz;
-						
-						/* Wrap-around handling */
-						if (updated_particle.x > 1.0f) updated_particle.x -= 2.0f;
-						else if (updated_particle.x < -1.0f) updated_particle.x += 2.0f;
-						
-						if (updated_particle.y > 1.0f) updated_particle.y -= 2.0f;
-						else if (updated_particle.y < -1.0f) updated_particle.y += 2.0f;
-						
-						if (updated_particle.z > 1.0f) updated_particle.z -= 2.0f;
-						else if (updated_particle.z < -1.0f) updated_particle.z += 2.0f;
-						
-						/* Find new grid position for the updated particle */
-						new_gx = coord_to_grid(updated_particle.x);
-						new_gy = coord_to_grid(updated_particle.y);
-						new_gz = coord_to_grid(updated_particle.z);
-						
-						/* Add to this thread's temporary grid (THREAD-SAFE) */
-						if (thread_id == 0) {
-							add_particle_to_grid(&temp_grid1[new_gx][new_gy][new_gz], updated_particle);
-						} else {
-							add_particle_to_grid(&temp_grid2[new_gx][new_gy][new_gz], updated_particle);
-						}
-					}
-				}
-			}
+		/* Forget the particles this thread moved last step */
+		clear_bins(thread_id);
+		
+		/* Process the grid cells in this thread's slab of X planes */
+		last = grid_first_cell(data->slab_end);
+		for (c = grid_first_cell(data->slab_start); c < last; c++) {
+			cell = grid_cell(c, &gx, &gy, &gz);
+			
+			/* Skip empty cells */
+			if (cell->count == 0) continue;
+			
+			process_cell(data, &params, cell, gx, gy, gz);
+		}
+		
+		data->force_usec += time_usec() - phase_start;
+		
+		/* Wait for all threads to finish the force pass */
+		pthread_barrier_wait(&barrier);
+		
+		phase_start = time_usec();
+		
+		/* Merge and swap only the planes this thread owns, so every buffer of the
+		 * slab is allocated and touched by a thread on the slab's node */
+		for (gx = data->slab_start; gx < data->slab_end; gx++) {
+			merge_plane(gx, thread_id);
+			swap_plane(gx);
 		}
 		
+		data->merge_usec += time_usec() - phase_start;
+		
 		/* Wait for all threads to be done */
 		pthread_barrier_wait(&barrier);
 	}
@@ -331,100 +1526,206 @@ static void* particle_worker(void* arg) {
 }
 
 void update_particles(void) {
-	int gx, gy, gz, i;
+	long analysed_step = step_count;
 	
-	/* STEP 1: Clear work_grid */
-	for (gx = 0; gx < GRID_SIZE; gx++) {
-		for (gy = 0; gy < GRID_SIZE; gy++) {
-			for (gz = 0; gz < GRID_SIZE; gz++) {
-				work_grid[gx][gy][gz].count = 0;
-			}
-		}
+#if SPARSE_GRID
+	/* Particles spawned since the last step join their planes */
+	sync_grid();
+#endif
+	
+	/* The neighbor stencil follows the interaction cutoff */
+	update_stencil(sim_params.max_dist_sq);
+	
+	/* Cluster analysis of the current state runs alongside this step */
+	cluster_pass = clusters_due(analysed_step);
+	if (cluster_pass) {
+		clusters_prepare();
 	}
 	
-	/* STEP 2: Signal threads to start working */
+	/* STEP 1: Signal threads to start the force pass */
 	pthread_barrier_wait(&barrier);
 	
-	/* STEP 3: Wait for threads to finish */
+	/* STEP 2: Wait for the force pass - threads then merge their own slabs */
 	pthread_barrier_wait(&barrier);
 	
-	/* STEP 4: Combine results from both temporary grids to work_grid */
-	for (gx = 0; gx < GRID_SIZE; gx++) {
-		for (gy = 0; gy < GRID_SIZE; gy++) {
-			for (gz = 0; gz < GRID_SIZE; gz++) {
-				/* Copy particles from temp_grid1 */
-				for (i = 0; i < temp_grid1[gx][gy][gz].count; i++) {
-					add_particle_to_grid(&work_grid[gx][gy][gz], 
-									   temp_grid1[gx][gy][gz].particles[i]);
-				}
-				
-				/* Copy particles from temp_grid2 */
-				for (i = 0; i < temp_grid2[gx][gy][gz].count; i++) {
-					add_particle_to_grid(&work_grid[gx][gy][gz], 
-									   temp_grid2[gx][gy][gz].particles[i]);
-				}
-			}
-		}
+	/* STEP 3: Wait for threads to finish merging (STEP 4) and swapping (STEP 5) */
+	pthread_barrier_wait(&barrier);
+	
+	set_rehome(0);
+#if SPARSE_GRID
+	index_dirty = 1;  /* The planes were rebuilt */
+#endif
+	release_doomed_ids();
+	step_count++;
+	stats_steps++;
+	
+	if (cluster_pass) {
+		clusters_finish(analysed_step);
+		print_cluster_stats();
+		cluster_pass = 0;
 	}
 	
-	/* STEP 5: Swap grid and work_grid */
-	for (gx = 0; gx < GRID_SIZE; gx++) {
-		for (gy = 0; gy < GRID_SIZE; gy++) {
-			for (gz = 0; gz < GRID_SIZE; gz++) {
-				GridCell temp = grid[gx][gy][gz];
-				grid[gx][gy][gz] = work_grid[gx][gy][gz];
-				work_grid[gx][gy][gz] = temp;
+	if (numa_report_interval > 0 && step_count % numa_report_interval == 0) {
+		print_numa_stats();
+	}
+}
+
+/* Print per-node timing and cross-node traffic, then reset the counters */
+void print_numa_stats(void) {
+	int node, t, node_threads, node_start, node_end;
+	long particles, exported;
+	double force_usec, merge_usec, max_usec, steps;
+	
+	if (!threads_running || stats_steps == 0) return;
+	
+	steps = (double)stats_steps;
+	stats_steps = 0;
+	
+	printf("NUMA stats after %ld steps (%d threads, %d nodes%s):\n",
+		   step_count, num_threads, numa_nodes, thread_pinning ? ", pinned" : "");
+	
+	for (node = 0; node < numa_nodes; node++) {
+		node_threads = 0;
+		node_start = node_end = 0;
+		particles = exported = 0;
+		force_usec = merge_usec = max_usec = 0.0;
+		
+		for (t = 0; t < num_threads; t++) {
+			if (thread_data[t].node != node) continue;
+			node_threads++;
+			node_start = thread_data[t].node_start;
+			node_end = thread_data[t].node_end;
+			particles += thread_data[t].particles;
+			exported += thread_data[t].exported;
+			force_usec += thread_data[t].force_usec;
+			merge_usec += thread_data[t].merge_usec;
+			if (thread_data[t].force_usec + thread_data[t].merge_usec > max_usec) {
+				max_usec = thread_data[t].force_usec + thread_data[t].merge_usec;
 			}
+			
+			thread_data[t].particles = thread_data[t].exported = 0;
+			thread_data[t].force_usec = thread_data[t].merge_usec = 0.0;
 		}
+		
+		if (node_threads == 0) continue;
+		
+		printf("  node %d: planes %d-%d, %d threads, %.0f particles/step, "
+			   "force %.3f ms, merge %.3f ms, slowest %.3f ms, exported %.1f%%\n",
+			   node, node_start, node_end - 1, node_threads,
+			   particles / steps,
+			   force_usec / node_threads / steps / 1000.0,
+			   merge_usec / node_threads / steps / 1000.0,
+			   max_usec / steps / 1000.0,
+			   particles > 0 ? 100.0 * exported / particles : 0.0);
 	}
 }
 
 /* Threading functions for pthread implementation */
 void init_threads(void) {
-	static ThreadData thread_data[2];
+	pthread_attr_t attr;
+	int t, node, first, last, index_in_node;
+	
+	if (num_threads < 1) num_threads = 1;
+	if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+	if (numa_nodes < 1) numa_nodes = 1;
+	if (numa_nodes > num_threads) numa_nodes = num_threads;
+	
+	/* CPUs are assumed to be numbered node by node */
+	if (cpus_per_node < 1) cpus_per_node = online_cpus() / numa_nodes;
+	if (cpus_per_node < 1) cpus_per_node = 1;
+	
+	/* Each worker owns a contiguous slab of X planes; consecutive workers are
+	 * grouped into nodes so every node owns one contiguous region of the grid.
+	 * With -pin each worker runs on a CPU of its own node, so the memory it
+	 * touches first is placed there. */
+	index_in_node = 0;
+	for (t = 0; t < num_threads; t++) {
+		thread_data[t].thread_id = t;
+		thread_data[t].node = t * numa_nodes / num_threads;
+		if (t > 0 && thread_data[t].node != thread_data[t - 1].node) index_in_node = 0;
+		thread_data[t].cpu = thread_data[t].node * cpus_per_node + index_in_node % cpus_per_node;
+		index_in_node++;
+		thread_data[t].slab_start = t * GRID_SIZE / num_threads;
+		thread_data[t].slab_end = (t + 1) * GRID_SIZE / num_threads;
+		thread_data[t].force_usec = thread_data[t].merge_usec = 0.0;
+		thread_data[t].particles = thread_data[t].exported = 0;
+	}
+	for (node = 0; node < numa_nodes; node++) {
+		first = GRID_SIZE;
+		last = 0;
+		for (t = 0; t < num_threads; t++) {
+			if (thread_data[t].node != node) continue;
+			if (thread_data[t].slab_start < first) first = thread_data[t].slab_start;
+			if (thread_data[t].slab_end > last) last = thread_data[t].slab_end;
+		}
+		for (t = 0; t < num_threads; t++) {
+			if (thread_data[t].node != node) continue;
+			thread_data[t].node_start = first;
+			thread_data[t].node_end = last;
+		}
+	}
 	
-	/* Initialize barrier for 3 threads (main + 2 worker threads) */
-	if (pthread_barrier_init(&barrier, NULL, 3) != 0) {
+	/* Initialize barrier for main + worker threads */
+	if (pthread_barrier_init(&barrier, NULL, num_threads + 1) != 0) {
 		printf("CRITICAL ERROR: Could not initialize pthread barrier!\n");
 		return;
 	}
 	
-	threads_running = 1;
+	pthread_attr_init(&attr);
+#if defined(__sgi)
+	/* IRIX only honours pthread_setrunon_np() for system-bound threads */
+	if (thread_pinning) {
+		pthread_attr_setscope(&attr, PTHREAD_SCOPE_BOUND_NP);
+	}
+#endif
 	
-	/* Create thread data */
-	thread_data[0].thread_id = 0;  /* Even cells */
-	thread_data[1].thread_id = 1;  /* Odd cells */
+	threads_running = 1;
+	set_rehome(1);  /* Slabs may have changed owners */
+	step_count = 0;
+	stats_steps = 0;
 	
 	/* Create worker threads */
-	if (pthread_create(&thread1, NULL, particle_worker, &thread_data[0]) != 0) {
-		printf("CRITICAL ERROR: Could not create thread 1!\n");
-		threads_running = 0;
-		return;
+	for (t = 0; t < num_threads; t++) {
+		if (pthread_create(&threads[t], &attr, particle_worker, &thread_data[t]) != 0) {
+			printf("CRITICAL ERROR: Could not create thread %d!\n", t + 1);
+			threads_running = 0;
+			while (--t >= 0) {
+				pthread_cancel(threads[t]);
+			}
+			pthread_attr_destroy(&attr);
+			return;
+		}
 	}
 	
-	if (pthread_create(&thread2, NULL, particle_worker, &thread_data[1]) != 0) {
-		printf("CRITICAL ERROR: Could not create thread 2!\n");
-		threads_running = 0;
-		pthread_cancel(thread1);
-		return;
-	}
+	pthread_attr_destroy(&attr);
 	
-	printf("Pthread system initialized with 2 worker threads\n");
+	if (thread_pinning) {
+		printf("Pthread system initialized with %d worker threads on %d NUMA nodes "
+			   "(pinned, %d CPUs per node)\n", num_threads, numa_nodes, cpus_per_node);
+	} else {
+		printf("Pthread system initialized with %d worker threads on %d NUMA nodes\n",
+			   num_threads, numa_nodes);
+	}
 }
 
 void cleanup_threads(void) {
-	int gx, gy, gz;
+	int t;
 	
 	/* Stop threads if they are running */
 	if (threads_running) {
+		if (numa_report_interval > 0) {
+			print_numa_stats();
+		}
+		
 		threads_running = 0;
 		
 		/* Signal threads to exit */
 		pthread_barrier_wait(&barrier);
 		
 		/* Wait for threads to finish */
-		pthread_join(thread1, NULL);
-		pthread_join(thread2, NULL);
+		for (t = 0; t < num_threads; t++) {
+			pthread_join(threads[t], NULL);
+		}
 		
 		/* Destroy barrier */
 		pthread_barrier_destroy(&barrier);
@@ -432,27 +1733,33 @@ void cleanup_threads(void) {
 		printf("Pthread system shut down\n");
 	}
 	
+	clusters_cleanup();
+	
+	/* Free the ID registry */
+	free(id_state);
+	free(id_type);
+	free(id_slot);
+	id_state = id_type = NULL;
+	id_slot = NULL;
+	id_capacity = 0;
+	free(free_ids.ids);
+	free(doomed_ids.ids);
+	free_ids.ids = doomed_ids.ids = NULL;
+	free_ids.capacity = doomed_ids.capacity = 0;
+	for (t = 0; t < NUM_TYPES; t++) {
+		free(type_ids[t].ids);
+		type_ids[t].ids = NULL;
+		type_ids[t].capacity = 0;
+	}
+	reset_ids();
+	
 	/* Free memory from all grids */
-	for (gx = 0; gx < GRID_SIZE; gx++) {
-		for (gy = 0; gy < GRID_SIZE; gy++) {
-			for (gz = 0; gz < GRID_SIZE; gz++) {
-				if (grid[gx][gy][gz].particles) {
-					free(grid[gx][gy][gz].particles);
-					grid[gx][gy][gz].particles = NULL;
-				}
-				if (work_grid[gx][gy][gz].particles) {
-					free(work_grid[gx][gy][gz].particles);
-					work_grid[gx][gy][gz].particles = NULL;
-				}
-				if (temp_grid1[gx][gy][gz].particles) {
-					free(temp_grid1[gx][gy][gz].particles);
-					temp_grid1[gx][gy][gz].particles = NULL;
-				}
-				if (temp_grid2[gx][gy][gz].particles) {
-					free(temp_grid2[gx][gy][gz].particles);
-					temp_grid2[gx][gy][gz].particles = NULL;
-				}
-			}
-		}
+	free_grids();
+	
+	free_stencil();
+	for (t = 0; t < MAX_THREADS; t++) {
+		free(thread_data[t].neighbors);
+		thread_data[t].neighbors = NULL;
+		thread_data[t].neighbor_capacity = 0;
 	}
 }
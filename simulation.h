@@ -1,19 +1,73 @@
 #ifndef SIMULATION_H
 #define SIMULATION_H
 
+/* Spatial dimensions, fixed at compile time: build with -DSIM_DIMS=2 for the
+ * planar simulation (GRID_SIZE^2 grid, no z components) */
+#ifndef SIM_DIMS
+#define SIM_DIMS 3
+#endif
+#if SIM_DIMS != 2 && SIM_DIMS != 3
+#error "SIM_DIMS must be 2 or 3"
+#endif
+
+/* Grid storage, fixed at compile time: with -DSPARSE_GRID=1 only occupied
+ * cells are stored (per X plane, in a hash table), so large GRID_SIZE values
+ * cost memory and time per occupied cell instead of per GRID_SIZE^3 cells */
+#ifndef SPARSE_GRID
+#define SPARSE_GRID 0
+#endif
+
 #define NUM_TYPES 6
+#ifndef GRID_SIZE
 #define GRID_SIZE 12
+#endif
 #define WORLD_SIZE 2.0f
 #define CELL_SIZE (WORLD_SIZE / GRID_SIZE)
 #define MAX_INTERACTION_DISTANCE 0.35f
 #define MAX_PARTICLES 2000  /* Maximum particles for vertex arrays */
+#ifndef MAX_CPUS
+#define MAX_CPUS 12         /* Processors the thread arrays are sized for */
+#endif
+/* Upper bound for worker threads - each owns a slab of at least one X plane */
+#define MAX_THREADS (GRID_SIZE < MAX_CPUS ? GRID_SIZE : MAX_CPUS)
+
+#if SIM_DIMS == 3
+#define GRID_SIZE_Z GRID_SIZE  /* Cells along Z */
+#else
+#define GRID_SIZE_Z 1
+#endif
 
 typedef struct {
+#if SIM_DIMS == 3
 	float x, y, z;        // 3D coordinates
 	float vx, vy, vz;     // 3D velocity
+#else
+	float x, y;           // 2D coordinates
+	float vx, vy;         // 2D velocity
+#endif
 	int type;
+	int id;               // Stable ID for spawn/remove
 } Cell;
 
+/* Z components for code shared by both modes - the plane is z = 0 in 2D */
+#if SIM_DIMS == 3
+#define CELL_Z(p) ((p)->z)
+#define CELL_VZ(p) ((p)->vz)
+#else
+#define CELL_Z(p) 0.0f
+#define CELL_VZ(p) 0.0f
+#endif
+
+/* Physics parameters, read by the workers at the start of every step */
+typedef struct {
+	float vmix;             // Velocity kept per step (1 - friction)
+	float center_force;     // Pull toward the origin
+	float base_radius;      // Particle radius at z = -1
+	float collision_force;  // Short-range repulsion strength
+	float max_dist_sq;      // Squared interaction cutoff
+	float force_scale;      // Force to velocity factor
+} SimParams;
+
 typedef struct {
 	int count;
 	int capacity;         // How many can fit
@@ -21,17 +75,47 @@ typedef struct {
 } GridCell;
 
 /* Global variables */
-extern GridCell grid[GRID_SIZE][GRID_SIZE][GRID_SIZE];
-extern GridCell work_grid[GRID_SIZE][GRID_SIZE][GRID_SIZE];
-extern GridCell temp_grid1[GRID_SIZE][GRID_SIZE][GRID_SIZE]; // New temporary grids
-extern GridCell temp_grid2[GRID_SIZE][GRID_SIZE][GRID_SIZE];
-extern int total_particles;
+#if !SPARSE_GRID
+extern GridCell grid[GRID_SIZE][GRID_SIZE][GRID_SIZE_Z];
+extern GridCell work_grid[GRID_SIZE][GRID_SIZE][GRID_SIZE_Z];
+extern GridCell *temp_grids[MAX_THREADS];  // One temporary grid per worker, allocated by the worker
+#endif
+extern int total_particles;  // Particles alive (initial count for init_grid_with_particles)
 extern float colors[NUM_TYPES][3];
+extern float attraction[NUM_TYPES][NUM_TYPES];
+extern SimParams sim_params;
+
+/* Threading / NUMA options - set before init_threads() */
+extern int num_threads;           // Worker threads, each owns a slab of X planes
+extern int numa_nodes;            // Number of NUMA regions the slabs are grouped into
+extern int thread_pinning;        // Pin every worker to a CPU of its own node
+extern int cpus_per_node;         // CPUs per NUMA node for pinning (0 = online CPUs / numa_nodes)
+extern int numa_report_interval;  // Print per-node stats every N steps (0 = off)
 
 /* Functions */
 void init_grid_with_particles(void);
 void init_threads(void);
 void update_particles(void);
 void cleanup_threads(void);
+void print_numa_stats(void);
+int count_particles(void);
+
+/* Grid access for both storage layouts - call between steps, or from the
+ * workers while the grid is read-only. Cells are numbered X plane by X plane
+ * (then Y, then Z); the sparse grid numbers only its occupied cells. */
+int grid_cell_count(void);
+int grid_first_cell(int gx);  // First cell of X plane gx (grid_cell_count() for GRID_SIZE)
+GridCell *grid_cell(int index, int *gx, int *gy, int *gz);  // Coordinates may be NULL
+GridCell *grid_find(int gx, int gy, int gz, int *index);    // NULL outside the grid or if not stored
+
+/* Population changes - call between steps only. In 2D the z arguments are ignored. */
+int spawn_particle(float x, float y, float z, int type);
+int remove_particle(int id);
+int remove_particles_of_type(int type, int count);
+int remove_particles_in_region(float min_x, float min_y, float min_z,
+							   float max_x, float max_y, float max_z);
+int set_particle_count(int count);
+int particle_removed(int id);  // Removed, but left in the grid until the next step
+int write_snapshot(const char *filename);
 
 #endif